@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -9,21 +10,24 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL; // <--- NEW
   initValueArray(&chunk->constants);
+  chunk->cacheCount = 0;
+  chunk->caches = NULL;
 }
 
-void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity); // <--- NEW
-  freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+  FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(vm, int, chunk->lines, chunk->capacity); // <--- NEW
+  freeValueArray(vm, &chunk->constants);
+  FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCount);
   initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity); // <--- NEW
+    chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+    chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity, chunk->capacity); // <--- NEW
   }
 
   chunk->code[chunk->count] = byte;
@@ -31,7 +35,16 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
   chunk->count++;
 }
 
-int addConstant(Chunk* chunk, Value value) {
-  writeValueArray(&chunk->constants, value);
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+  writeValueArray(vm, &chunk->constants, value);
   return chunk->constants.count - 1;
+}
+
+// Caches are added once per site while compiling, so the array grows
+// by exactly one each time.
+int addCache(VM* vm, Chunk* chunk) {
+  chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches,
+                             chunk->cacheCount, chunk->cacheCount + 1);
+  memset(&chunk->caches[chunk->cacheCount], 0, sizeof(InlineCache));
+  return chunk->cacheCount++;
 }
\ No newline at end of file
@@ -26,26 +26,70 @@ typedef enum {
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  OP_MODULO,
+  OP_BIT_AND,
+  OP_BIT_OR,
+  OP_BIT_XOR,
+  OP_SHIFT_LEFT,
+  OP_SHIFT_RIGHT,
   OP_NOT,
   OP_NEGATE,
+  OP_BIT_NOT,
   OP_PRINT,
   OP_RETURN,
   OP_CLOSURE,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
+  OP_PEEK,
+  OP_INLINE_GUARD,
+  OP_INLINE_RETURN,
+  OP_BUILD_LIST,
+  OP_LIST_APPEND,
+  OP_INDEX_GET,
+  OP_INDEX_SET,
+  OP_BUILD_MAP,
+  OP_MAP_INSERT,
+  OP_CLASS,
+  OP_METHOD,
+  OP_GET_PROPERTY,
+  OP_SET_PROPERTY,
+  OP_INVOKE,
 } OpCode;
 
+// Inline cache for one property access or method call site. Each entry
+// remembers where the field, or which method, is found for one receiver
+// shape, so a repeat visit skips the lookup. A site that sees more
+// shapes than there are entries keeps replacing its last one.
+#define INLINE_CACHE_WAYS 4
+
+struct ObjShape;
+struct ObjClosure;
+
+typedef struct {
+  struct ObjShape* shape;  // Receiver shape; NULL if the entry is unused
+  struct ObjShape* target; // Shape after a store, which may add the field
+  int slot;                // Index of the field
+  struct ObjClosure* method; // Method an invoke resolved to, if not a field
+} CacheEntry;
+
+typedef struct {
+  CacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
   int* lines; //Stores line number for each byte of code
   ValueArray constants;
+  int cacheCount;
+  InlineCache* caches; // Indexed by the operand of property instructions
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line); //Note the extra argument!
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line); //Note the extra argument!
+int addConstant(VM* vm, Chunk* chunk, Value value);
+int addCache(VM* vm, Chunk* chunk);
 
 #endif
\ No newline at end of file
@@ -7,6 +7,14 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// One interpreter instance (see vm.h). Everything that allocates takes
+// one, so independent VMs can run side by side, one per thread.
+typedef struct VM VM;
+
+// Tables keep a byte of hash bits per slot and probe 16 slots at a
+// time; comment out for plain linear probing over the entries
+#define TABLE_SWISS
+
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
 
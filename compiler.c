@@ -4,6 +4,8 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "number.h"
 #include "scanner.h"
 #include "object.h" 
 
@@ -11,28 +13,26 @@
 #include "debug.h"
 #endif
 
-typedef struct {
-  Token current;
-  Token previous;
-  bool hadError;
-  bool panicMode;
-} Parser;
-
 //#define UINT8_COUNT (UINT8_MAX +1) //globally declared in common.h
 
 typedef enum {
   PREC_NONE, PREC_ASSIGNMENT, PREC_OR, PREC_AND, PREC_EQUALITY,
-  PREC_COMPARISON, PREC_TERM, PREC_FACTOR, PREC_UNARY, PREC_CALL, PREC_PRIMARY
+  PREC_COMPARISON, PREC_BIT_OR, PREC_BIT_XOR, PREC_BIT_AND, PREC_SHIFT, PREC_TERM, PREC_FACTOR, PREC_UNARY, PREC_CALL, PREC_PRIMARY
 } Precedence;
 
 typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  bool isConst;
+  bool isFolded; // A const whose value is known: reads emit 'constant'
+  Value constant;
 } Local;
 
 typedef enum {
   TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
   TYPE_SCRIPT
 } FunctionType;
 
@@ -52,7 +52,41 @@ typedef struct Compiler {
   int scopeDepth;
 } Compiler;
 
-typedef void (*ParseFn)();
+typedef struct ClassCompiler {
+  struct ClassCompiler* enclosing;
+} ClassCompiler;
+
+// Everything one compilation works on. Each compile() call has its own,
+// so separate VMs can compile at the same time.
+typedef struct {
+  VM* vm;
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool hadError;
+  bool panicMode;
+  Compiler* compiler;
+  ClassCompiler* currentClass;
+  // Global functions declared so far in this compilation that are small
+  // enough to inline, keyed by name. Only filled when inlining is enabled.
+  Table inlineCandidates;
+  // Offset of the last OP_GET_GLOBAL read, so call() can tell whether its
+  // callee is a plain global.
+  int lastGlobalGet;
+  // Offset where the left operand of the infix rule being parsed starts.
+  int lastOperandStart;
+  // Top-level consts declared in this compilation. Every const name is in
+  // constNames; the ones with a compile-time value are also in constValues
+  // and get propagated into the code that reads them. They join the VM's
+  // tables once the compilation succeeds, so later ones see them too.
+  Table constNames;
+  Table constValues;
+} Parser;
+
+// Largest function body, in bytes of bytecode, that calls get inlined.
+#define INLINE_MAX_SIZE 32
+
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -60,28 +94,31 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Compiler* current = NULL;
+CompilerOptions compilerOptions = { false, false };
 
 
 //FORWARD DECLARATIONS: let compiler know this fn exists
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-
-static void initCompiler(Compiler* compiler, FunctionType type);
-static void beginScope();
-static void block();
-
-static Chunk* currentChunk() {
-  return &current->function->chunk;
+static void parsePrecedence(Parser* parser, Precedence precedence);
+static void namedVariable(Parser* parser, Token name, bool canAssign);
+static uint8_t argumentList(Parser* parser);
+
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type);
+static void beginScope(Parser* parser);
+static void block(Parser* parser);
+static int emitJump(Parser* parser, uint8_t instruction);
+static void patchJump(Parser* parser, int offset);
+
+static Chunk* currentChunk(Parser* parser) {
+  return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+  if (parser->panicMode) return;
+  parser->panicMode = true;
   
   fprintf(stderr, "[line %d] Error", token->line);
   if (token->type == TOKEN_EOF) fprintf(stderr, " at end");
@@ -89,91 +126,299 @@ static void errorAt(Token* token, const char* message) {
   else if (token->type != TOKEN_ERROR) fprintf(stderr, " at '%.*s'", token->length, token->start);
 
   fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  parser->hadError = true;
 }
 
-static void error(const char* message) { errorAt(&parser.previous, message); }
-static void errorAtCurrent(const char* message) { errorAt(&parser.current, message); }
+static void error(Parser* parser, const char* message) { errorAt(parser, &parser->previous, message); }
+static void errorAtCurrent(Parser* parser, const char* message) { errorAt(parser, &parser->current, message); }
 
 //HELPER FUNCTIONS MOVED TO TOP
 
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser* parser) {
+  parser->previous = parser->current;
   for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) break;
-    errorAtCurrent(parser.current.start);
+    parser->current = scanToken(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR) break;
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) { advance(); return; }
-  errorAtCurrent(message);
+static void consume(Parser* parser, TokenType type, const char* message) {
+  if (parser->current.type == type) { advance(parser); return; }
+  errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-  return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+  return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
+static bool match(Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;
+  advance(parser);
   return true;
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+  writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
+}
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) { emitByte(parser, byte1); emitByte(parser, byte2); }
+
+static void emitReturn(Parser* parser) { 
+  // An initializer always returns the instance, held in slot zero
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);
+  } else {
+    emitByte(parser, OP_NIL);
+  }
+  emitByte(parser, OP_RETURN); 
+}
+
+// Gives the property instruction just emitted its own inline cache
+static void emitCache(Parser* parser) {
+  int cache = addCache(parser->vm, currentChunk(parser));
+  if (cache > UINT16_MAX) {
+    error(parser, "Too many property accesses in one chunk.");
+    return;
+  }
+  emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff);
 }
-static void emitBytes(uint8_t byte1, uint8_t byte2) { emitByte(byte1); emitByte(byte2); }
 
-static void emitReturn() { 
-  emitByte(OP_NIL);
-  emitByte(OP_RETURN); 
+// Finds the most stack slots 'function' can use, counting from its slot
+// zero, by following every path through its code and tracking the stack
+// height each instruction leaves behind. call() checks this once per
+// frame so push() itself never has to.
+static int maxStackSlots(Parser* parser, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  if (chunk->count == 0) return 0;
+
+  int* depths = ALLOCATE(parser->vm, int, chunk->count);
+  int* worklist = ALLOCATE(parser->vm, int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+  int start = function->arity + 1; // The callee and its arguments
+  int maxDepth = start;
+  int pending = 0;
+  depths[0] = start;
+  worklist[pending++] = 0;
+
+  while (pending > 0) {
+    int offset = worklist[--pending];
+    int depth = depths[offset];
+    uint8_t* code = &chunk->code[offset];
+    int length = 1;
+    int jump = -1;      // Branch target, if any
+    bool falls = true;  // Whether execution continues at the next instruction
+
+    switch (code[0]) {
+      case OP_NIL: case OP_TRUE: case OP_FALSE:
+        depth++;
+        break;
+      case OP_CONSTANT: case OP_GET_LOCAL: case OP_GET_GLOBAL:
+      case OP_GET_UPVALUE: case OP_PEEK:
+        depth++;
+        length = 2;
+        break;
+      case OP_SET_LOCAL: case OP_SET_GLOBAL: case OP_SET_UPVALUE:
+        length = 2;
+        break;
+      case OP_DEFINE_GLOBAL: case OP_METHOD:
+        depth--;
+        length = 2;
+        break;
+      case OP_CLASS:
+        depth++;
+        length = 2;
+        break;
+      case OP_GET_PROPERTY:
+        length = 4;
+        break;
+      case OP_SET_PROPERTY:
+        depth--;
+        length = 4;
+        break;
+      case OP_INVOKE:
+        depth -= code[2];
+        length = 5;
+        break;
+      case OP_POP: case OP_PRINT:
+      case OP_EQUAL: case OP_GREATER: case OP_LESS:
+      case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+      case OP_MODULO: case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR:
+      case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+        depth--;
+        break;
+      case OP_NOT: case OP_NEGATE: case OP_BIT_NOT:
+        break;
+      case OP_CALL: case OP_INLINE_RETURN:
+        depth -= code[1];
+        length = 2;
+        break;
+      case OP_BUILD_LIST:
+        depth -= code[1] - 1;
+        length = 2;
+        break;
+      case OP_LIST_APPEND: case OP_INDEX_GET:
+        depth--;
+        break;
+      case OP_INDEX_SET: case OP_MAP_INSERT:
+        depth -= 2;
+        break;
+      case OP_BUILD_MAP:
+        depth -= code[1] * 2 - 1;
+        length = 2;
+        break;
+      case OP_CLOSURE: {
+        ObjFunction* closure =
+            AS_FUNCTION(chunk->constants.values[code[1]]);
+        depth++;
+        length = 2 + closure->upvalueCount * 2;
+        break;
+      }
+      case OP_JUMP:
+        length = 3;
+        jump = offset + 3 + ((code[1] << 8) | code[2]);
+        falls = false;
+        break;
+      case OP_JUMP_IF_FALSE:
+        length = 3;
+        jump = offset + 3 + ((code[1] << 8) | code[2]);
+        break;
+      case OP_LOOP:
+        length = 3;
+        jump = offset + 3 - ((code[1] << 8) | code[2]);
+        falls = false;
+        break;
+      case OP_INLINE_GUARD:
+        length = 5;
+        jump = offset + 5 + ((code[3] << 8) | code[4]);
+        break;
+      case OP_RETURN:
+        falls = false;
+        break;
+    }
+
+    if (depth > maxDepth) maxDepth = depth;
+
+    int next = offset + length;
+    if (falls && next < chunk->count && depths[next] == -1) {
+      depths[next] = depth;
+      worklist[pending++] = next;
+    }
+    if (jump >= 0 && jump < chunk->count && depths[jump] == -1) {
+      depths[jump] = depth;
+      worklist[pending++] = jump;
+    }
+  }
+
+  FREE_ARRAY(parser->vm, int, depths, chunk->count);
+  FREE_ARRAY(parser->vm, int, worklist, chunk->count);
+  return maxDepth;
 }
 
-static ObjFunction* endCompiler() {
-  emitReturn();
-  ObjFunction* function = current->function;
+static ObjFunction* endCompiler(Parser* parser) {
+  emitReturn(parser);
+  ObjFunction* function = parser->compiler->function;
+  function->maxSlots = maxStackSlots(parser, function);
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
-    disassembleChunk(currentChunk(), function->name != NULL
+  if (!parser->hadError) {
+    disassembleChunk(currentChunk(parser), function->name != NULL
         ? function->name->chars : "<script>");
   }
 #endif
 
-  current = current->enclosing; //Restore the previous compiler
+  parser->compiler = parser->compiler->enclosing; //Restore the previous compiler
   return function;
 }
 
-static uint8_t makeConstant(Value value) {
-  int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value) {
+  int constant = addConstant(parser->vm, currentChunk(parser), value);
   if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
+    error(parser, "Too many constants in one chunk.");
     return 0;
   }
   return (uint8_t)constant;
 }
 
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, (uint8_t)addConstant(currentChunk(), value));
+static void emitConstant(Parser* parser, Value value) {
+  emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
+// Emits the cheapest instruction that pushes 'value'.
+static void emitValue(Parser* parser, Value value) {
+  if (IS_NIL(value)) {
+    emitByte(parser, OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(parser, value);
+  }
+}
 
-static uint8_t identifierConstant(Token* name) {
+// If the code in [start, end) is exactly one instruction that pushes a
+// constant, stores that constant in 'value'.
+static bool constantOperand(Parser* parser, int start, int end, Value* value) {
+  Chunk* chunk = currentChunk(parser);
+  if (end - start == 1) {
+    switch (chunk->code[start]) {
+      case OP_NIL:   *value = NIL_VAL; return true;
+      case OP_TRUE:  *value = BOOL_VAL(true); return true;
+      case OP_FALSE: *value = BOOL_VAL(false); return true;
+      default: return false;
+    }
+  }
+  if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+    *value = chunk->constants.values[chunk->code[start + 1]];
+    return true;
+  }
+  return false;
+}
+
+// Throws away the code emitted from 'start' on, along with any constants
+// it had just added to the end of the pool.
+static void discardCode(Parser* parser, int start) {
+  Chunk* chunk = currentChunk(parser);
+  for (int offset = chunk->count - 2; offset >= start; offset--) {
+    if (chunk->code[offset] == OP_CONSTANT &&
+        chunk->code[offset + 1] == chunk->constants.count - 1) {
+      chunk->constants.count--;
+    }
+  }
+  chunk->count = start;
+}
+
+
+// Slot of a variable or property name in the constant pool. Strings are
+// interned, so a name the chunk already holds is found by its pointer
+// and every use of it shares one slot.
+static uint8_t nameConstant(Parser* parser, ObjString* name) {
+  ValueArray* constants = &currentChunk(parser)->constants;
+  for (int i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+    if (IS_OBJ(constants->values[i]) &&
+        AS_OBJ(constants->values[i]) == (Obj*)name) {
+      return (uint8_t)i;
+    }
+  }
+  return makeConstant(parser, OBJ_VAL(name));
+}
+
+static uint8_t identifierConstant(Parser* parser, Token* name) {
   // Take the string "x" from the source and create a String Object for it
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+  return nameConstant(parser, copyString(parser->vm, name->start, name->length));
 }
 
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+  if (parser->compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = &parser->compiler->locals[parser->compiler->localCount++];
   local->name = name;
   local->depth = -1; // -1 means "declared but not ready for use yet"
+  local->isCaptured = false;
+  local->isConst = false;
+  local->isFolded = false;
 }
 
 static bool identifierEqual(Token* a, Token* b) {
@@ -181,141 +426,453 @@ static bool identifierEqual(Token* a, Token* b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void declareVariable() {
-  if (current->scopeDepth == 0) return;
+static void declareVariable(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return;
 
-  Token* name = &parser.previous;
+  Token* name = &parser->previous;
   
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
+  for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+    Local* local = &parser->compiler->locals[i];
+    if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
       break; 
     }
 
     // FIX IS HERE: pass 'name', not '&name'
     if (identifierEqual(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+      error(parser, "Already a variable with this name in this scope.");
     }
   }
 
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+// True if 'name' is a global const, from this compilation or an
+// earlier one.
+static bool isConstGlobal(Parser* parser, ObjString* name) {
+  Value ignored;
+  return tableGet(&parser->constNames, name, &ignored) ||
+         tableGet(&parser->vm->constNames, name, &ignored);
+}
 
-  declareVariable(); //Track locals
-  if (current->scopeDepth > 0) return 0; // Return dummy 0 for locals
+static bool foldedGlobal(Parser* parser, ObjString* name, Value* value) {
+  return tableGet(&parser->constValues, name, value) ||
+         tableGet(&parser->vm->constValues, name, value);
+}
 
-  return identifierConstant(&parser.previous);
+static uint8_t parseVariable(Parser* parser, const char* errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
+
+  declareVariable(parser); //Track locals
+  if (parser->compiler->scopeDepth > 0) return 0; // Return dummy 0 for locals
+
+  uint8_t global = identifierConstant(parser, &parser->previous);
+  if (isConstGlobal(parser,
+                    AS_STRING(currentChunk(parser)->constants.values[global]))) {
+    error(parser, "Already a constant with this name.");
+  }
+  return global;
 }
 
-static void markInitialized() {
-  if (current->scopeDepth == 0) return;
-  current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return;
+  parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized(); // <--- NEW
+static void defineVariable(Parser* parser, uint8_t global) {
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser); // <--- NEW
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static void varDeclaration() {
+static void varDeclaration(Parser* parser) {
   // 1. Parse the variable name ("x")
-  uint8_t global = parseVariable("Expect variable name.");
+  uint8_t global = parseVariable(parser, "Expect variable name.");
 
   // 2. Parse the initializer ("= 10")
-  if (match(TOKEN_EQUAL)) {
-    expression(); // Compiles "10"
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser); // Compiles "10"
   } else {
     // Handling "var x;" (no value) -> default to nil
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
 
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
   // 3. Emit the instruction to save it
-  defineVariable(global);
+  defineVariable(parser, global);
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope(); 
+// const NAME = expr; behaves like var but can't be assigned. When the
+// initializer folds to a constant, reads of NAME compile to that constant
+// instead of a variable access.
+static void constDeclaration(Parser* parser) {
+  uint8_t global = parseVariable(parser, "Expect constant name.");
+  consume(parser, TOKEN_EQUAL, "Expect '=' after constant name.");
+
+  int start = currentChunk(parser)->count;
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+  Value value;
+  bool folded = constantOperand(parser, start, currentChunk(parser)->count, &value);
+  if (parser->compiler->scopeDepth > 0) {
+    Local* local = &parser->compiler->locals[parser->compiler->localCount - 1];
+    local->isConst = true;
+    local->isFolded = folded;
+    local->constant = folded ? value : NIL_VAL;
+  } else {
+    ObjString* name = AS_STRING(currentChunk(parser)->constants.values[global]);
+    tableSet(parser->vm, &parser->constNames, name, NIL_VAL);
+    if (folded) tableSet(parser->vm, &parser->constValues, name, value);
+  }
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  defineVariable(parser, global);
+}
+
+// True if 'name' matches a local of any function being compiled, i.e. a
+// body mentioning it might need an upvalue.
+static bool mayCapture(Parser* parser, Token* name) {
+  for (Compiler* compiler = parser->compiler; compiler != NULL;
+       compiler = compiler->enclosing) {
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+      if (identifierEqual(name, &compiler->locals[i].name)) return true;
+    }
+  }
+  return false;
+}
+
+// Lazy mode: skims the parameter list and body with the raw scanner to
+// find where the function ends, and emits a stub holding a copy of its
+// source instead of bytecode. Returns false (consuming nothing) when the
+// body might capture an enclosing local or looks malformed; the eager
+// path then compiles it and reports any errors.
+// Skims 'IDENT (',' IDENT)* ')' '{'', the rest of a signature after its
+// '(', and counts the parameters. False if it doesn't match.
+static bool skimSignature(Scanner* scanner, int* arity) {
+  Token token = scanToken(scanner);
+  if (token.type != TOKEN_RIGHT_PAREN) {
+    for (;;) {
+      if (token.type != TOKEN_IDENTIFIER) return false;
+      (*arity)++;
+      token = scanToken(scanner);
+      if (token.type != TOKEN_COMMA) break;
+      token = scanToken(scanner);
+    }
+    if (token.type != TOKEN_RIGHT_PAREN) return false;
+  }
+  return scanToken(scanner).type == TOKEN_LEFT_BRACE;
+}
+
+static bool lazyFunction(Parser* parser) {
+  Token name = parser->previous;
+  Token open = parser->current;
+  if (open.type != TOKEN_LEFT_PAREN) return false;
+
+  int arity = 0;
+  int depth = 0;
+  Token token = open;
+  if (skimSignature(&parser->scanner, &arity)) {
+    depth = 1;
+    for (;;) {
+      token = scanToken(&parser->scanner);
+      if (token.type == TOKEN_ERROR || token.type == TOKEN_EOF) break;
+
+      if (token.type == TOKEN_LEFT_BRACE) {
+        depth++;
+      } else if (token.type == TOKEN_RIGHT_BRACE) {
+        if (--depth == 0) break;
+      } else if (token.type == TOKEN_IDENTIFIER && mayCapture(parser, &token)) {
+        break;
+      }
+    }
+  }
+
+  if (token.type != TOKEN_RIGHT_BRACE || depth != 0 || arity > 255) {
+    rewindScanner(&parser->scanner, open.start + open.length, open.line);
+    return false;
+  }
+
+  ObjFunction* function = newFunction(parser->vm);
+  function->name = copyString(parser->vm, name.start, name.length);
+  function->arity = arity;
+  function->lazyLength = (int)(token.start + token.length - open.start);
+  function->lazyLine = open.line;
+  function->lazySource = ALLOCATE(parser->vm, char, function->lazyLength + 1);
+  memcpy(function->lazySource, open.start, function->lazyLength);
+  function->lazySource[function->lazyLength] = '\0';
+
+  parser->current = token;
+  advance(parser);
+  emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
+  return true;
+}
+
+static ObjFunction* functionBody(Parser* parser, Compiler* compiler, FunctionType type) {
+  initCompiler(parser, compiler, type);
+  beginScope(parser); 
+
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
   
   // Compile the parameter list
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Can't have more than 255 parameters.");
+      parser->compiler->function->arity++;
+      if (parser->compiler->function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
-      defineVariable(constant);
-    } while (match(TOKEN_COMMA));
+      uint8_t constant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, constant);
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(parser);
+
+  return endCompiler(parser);
+}
+
+static ObjFunction* function(Parser* parser, FunctionType type) {
+  // Lazy stubs are compiled as plain functions, so methods never are
+  if (type == TYPE_FUNCTION && compilerOptions.lazyFunctions &&
+      lazyFunction(parser)) {
+    return NULL;
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
 
   // Create the function object
-  ObjFunction* function = endCompiler();
+  Compiler compiler;
+  ObjFunction* function = functionBody(parser, &compiler, type);
   
   // Emit the code to store the function in a constant
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
   // Emit the upvalue information for the VM
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(parser, compiler.upvalues[i].index);
+  }
+  return function;
+}
+
+// Length of the code a call to 'function' could be replaced with, or -1
+// if it can't be inlined. That means a single 'return <expr>;' where the
+// expression only reads parameters, globals and constants, so it has no
+// jumps, calls (hence no recursion), locals or upvalues. The stack depth
+// is tracked so that a body which leaves anything besides the result
+// behind, like a local declared before the return, is turned down.
+static int inlineBodyLength(ObjFunction* function) {
+  if (function->upvalueCount > 0) return -1;
+
+  Chunk* chunk = &function->chunk;
+  int depth = 0;
+  for (int offset = 0; offset < chunk->count && offset <= INLINE_MAX_SIZE;) {
+    switch (chunk->code[offset]) {
+      case OP_RETURN:
+        return depth == 1 ? offset : -1;
+      case OP_GET_LOCAL:
+        if (chunk->code[offset + 1] == 0 ||
+            chunk->code[offset + 1] > function->arity) {
+          return -1;
+        }
+        depth++;
+        offset += 2;
+        break;
+      case OP_CONSTANT:
+      case OP_GET_GLOBAL:
+        depth++;
+        offset += 2;
+        break;
+      case OP_NIL: case OP_TRUE: case OP_FALSE:
+        depth++;
+        offset++;
+        break;
+      case OP_NOT: case OP_NEGATE: case OP_BIT_NOT:
+        offset++;
+        break;
+      case OP_EQUAL: case OP_GREATER: case OP_LESS:
+      case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+      case OP_MODULO: case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR:
+      case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+        if (--depth < 1) return -1;
+        offset++;
+        break;
+      default:
+        return -1;
+    }
+  }
+  return -1;
+}
+
+static void funDeclaration(Parser* parser) {
+  uint8_t global = parseVariable(parser, "Expect function name.");
+  markInitialized(parser);
+  ObjFunction* compiled = function(parser, TYPE_FUNCTION);
+
+  if (compilerOptions.inlineCalls && parser->compiler->scopeDepth == 0) {
+    ObjString* name = AS_STRING(currentChunk(parser)->constants.values[global]);
+    if (compiled != NULL && inlineBodyLength(compiled) != -1) {
+      tableSet(parser->vm, &parser->inlineCandidates, name, OBJ_VAL(compiled));
+    } else {
+      tableDelete(parser->vm, &parser->inlineCandidates, name);
+    }
   }
+
+  defineVariable(parser, global);
 }
 
-static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
-  markInitialized();
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+
+static void method(Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(parser, &parser->previous);
+
+  FunctionType type = TYPE_METHOD;
+  if (parser->previous.length == 4 &&
+      memcmp(parser->previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+  function(parser, type);
+  emitBytes(parser, OP_METHOD, constant);
 }
 
+static void classDeclaration(Parser* parser) {
+  uint8_t nameConstant = parseVariable(parser, "Expect class name.");
+  Token className = parser->previous;
 
-static void declaration() {
-  if (match(TOKEN_FUN)) {
-    funDeclaration();
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  emitBytes(parser, OP_CLASS, identifierConstant(parser, &className));
+  defineVariable(parser, nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = parser->currentClass;
+  parser->currentClass = &classCompiler;
+
+  // The class stays on the stack while its methods are attached
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
+
+  parser->currentClass = parser->currentClass->enclosing;
+}
+
+static void declaration(Parser* parser) {
+  if (match(parser, TOKEN_CLASS)) {
+    classDeclaration(parser);
+  } else if (match(parser, TOKEN_FUN)) {
+    funDeclaration(parser);
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
+  } else if (match(parser, TOKEN_CONST)) {
+    constDeclaration(parser);
   } else {
-    statement();
+    statement(parser);
   }
 }
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
 // --- GRAMMAR ---
 
-static void number() {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+  int64_t integer;
+  if (parseInteger(parser->previous.start, parser->previous.length, &integer)) {
+    emitConstant(parser, INT_VAL(integer));
+    return;
+  }
+  double value = parseNumber(parser->previous.start, parser->previous.length);
+  emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void string() {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+  emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void grouping() { expression(); consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression."); }
+// List literal. The first 255 elements are built in one go; any more
+// are appended one at a time.
+static void list(Parser* parser, bool canAssign) {
+  int count = 0;
+  bool built = false;
+  if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+    do {
+      if (check(parser, TOKEN_RIGHT_BRACKET)) break; // Trailing comma
+      expression(parser);
+      if (built) {
+        emitByte(parser, OP_LIST_APPEND);
+      } else if (++count == UINT8_MAX) {
+        emitBytes(parser, OP_BUILD_LIST, (uint8_t)count);
+        built = true;
+      }
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  if (!built) emitBytes(parser, OP_BUILD_LIST, (uint8_t)count);
+}
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+// A '{' that starts a statement is a block, so map literals only appear
+// where an expression is expected
+static void map(Parser* parser, bool canAssign) {
+  int count = 0;
+  bool built = false;
+  if (!check(parser, TOKEN_RIGHT_BRACE)) {
+    do {
+      if (check(parser, TOKEN_RIGHT_BRACE)) break; // Trailing comma
+      expression(parser);
+      consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+      expression(parser);
+      if (built) {
+        emitByte(parser, OP_MAP_INSERT);
+      } else if (++count == UINT8_MAX) {
+        emitBytes(parser, OP_BUILD_MAP, (uint8_t)count);
+        built = true;
+      }
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  if (!built) emitBytes(parser, OP_BUILD_MAP, (uint8_t)count);
+}
+
+static void subscript(Parser* parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitByte(parser, OP_INDEX_SET);
+  } else {
+    emitByte(parser, OP_INDEX_GET);
+  }
+}
+
+static void dot(Parser* parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(parser, &parser->previous);
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitBytes(parser, OP_SET_PROPERTY, name);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    // obj.name(args) calls the method directly, without binding it first
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_INVOKE, name);
+    emitByte(parser, argCount);
+  } else {
+    emitBytes(parser, OP_GET_PROPERTY, name);
+  }
+  emitCache(parser);
+}
+
+static void grouping(Parser* parser, bool canAssign) { expression(parser); consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression."); }
+
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if (identifierEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -324,7 +881,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1; // Not found in locals
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
   for (int i = 0; i < upvalueCount; i++) {
@@ -335,7 +892,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
   }
 
   if (upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+    error(parser, "Too many closure variables in function.");
     return 0;
   }
 
@@ -344,106 +901,314 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
   return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
   if (compiler->enclosing == NULL) return -1;
 
-  int local = resolveLocal(compiler->enclosing, name);
+  int local = resolveLocal(parser, compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(parser, compiler, (uint8_t)local, true);
   }
 
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
   }
 
   return -1;
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  int arg = resolveLocal(parser, parser->compiler, &name);
+  bool isConst = false;
+  bool isFolded = false;
+  Value constant = NIL_VAL;
 
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    Local* local = &parser->compiler->locals[arg];
+    isConst = local->isConst;
+    isFolded = local->isFolded;
+    constant = local->constant;
+  } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    ObjString* string = copyString(parser->vm, name.start, name.length);
+    isConst = isConstGlobal(parser, string);
+    isFolded = foldedGlobal(parser, string, &constant);
+    // A folded read needs no name in the constant pool.
+    arg = isFolded ? 0 : nameConstant(parser, string);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    if (isConst) error(parser, "Can't assign to a constant.");
+    expression(parser);
+    emitBytes(parser, setOp, (uint8_t)arg);
+  } else if (isFolded) {
+    emitValue(parser, constant);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitBytes(parser, getOp, (uint8_t)arg);
+    if (getOp == OP_GET_GLOBAL) parser->lastGlobalGet = currentChunk(parser)->count - 2;
   }
 }
 
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
+}
+
+static void this_(Parser* parser, bool canAssign) {
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
+    return;
+  }
+  variable(parser, false);
 }
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser* parser) {
   uint8_t argCount = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      expression(); // Compile the argument (e.g., "1" or "a + b")
+      expression(parser); // Compile the argument (e.g., "1" or "a + b")
       if (argCount == 255) {
-        error("Can't have more than 255 arguments.");
+        error(parser, "Can't have more than 255 arguments.");
       }
       argCount++;
-    } while (match(TOKEN_COMMA));
+    } while (match(parser, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return argCount;
 }
 
-static void call() { 
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+// Copies the body of 'function' in place of a call to it. The arguments
+// are already on the stack; parameter reads become OP_PEEKs at a distance
+// that accounts for the temporaries the body has pushed so far.
+static void emitInlinedBody(Parser* parser, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  int length = inlineBodyLength(function);
+  int depth = 0;
+
+  for (int offset = 0; offset < length;) {
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+      case OP_GET_LOCAL: {
+        int distance = depth + function->arity - chunk->code[offset + 1];
+        emitBytes(parser, OP_PEEK, (uint8_t)distance);
+        depth++;
+        offset += 2;
+        break;
+      }
+      case OP_CONSTANT:
+      case OP_GET_GLOBAL: {
+        Value constant = chunk->constants.values[chunk->code[offset + 1]];
+        uint8_t slot = instruction == OP_GET_GLOBAL
+            ? nameConstant(parser, AS_STRING(constant))
+            : makeConstant(parser, constant);
+        emitBytes(parser, instruction, slot);
+        depth++;
+        offset += 2;
+        break;
+      }
+      case OP_NIL: case OP_TRUE: case OP_FALSE:
+        emitByte(parser, instruction);
+        depth++;
+        offset++;
+        break;
+      case OP_NOT: case OP_NEGATE: case OP_BIT_NOT:
+        emitByte(parser, instruction);
+        offset++;
+        break;
+      default: // Binary operators
+        emitByte(parser, instruction);
+        depth--;
+        offset++;
+        break;
+    }
+  }
+}
+
+static void emitInlinedCall(Parser* parser, ObjFunction* function, uint8_t argCount) {
+  // Guard: if the callee on the stack isn't the function we inlined (the
+  // global was reassigned), jump to an ordinary call.
+  emitBytes(parser, OP_INLINE_GUARD, argCount);
+  emitByte(parser, makeConstant(parser, OBJ_VAL(function)));
+  int guardJump = currentChunk(parser)->count;
+  emitBytes(parser, 0xff, 0xff);
+
+  emitInlinedBody(parser, function);
+  emitBytes(parser, OP_INLINE_RETURN, argCount);
+  int endJump = emitJump(parser, OP_JUMP);
+
+  patchJump(parser, guardJump);
+  emitBytes(parser, OP_CALL, argCount);
+  patchJump(parser, endJump);
+}
+
+static void call(Parser* parser, bool canAssign) {
+  ObjFunction* inlined = NULL;
+  if (parser->inlineCandidates.count > 0 &&
+      parser->lastGlobalGet == currentChunk(parser)->count - 2 &&
+      currentChunk(parser)->code[parser->lastGlobalGet] == OP_GET_GLOBAL) {
+    Value name = currentChunk(parser)->constants.values[
+        currentChunk(parser)->code[parser->lastGlobalGet + 1]];
+    Value candidate;
+    if (tableGet(&parser->inlineCandidates, AS_STRING(name), &candidate)) {
+      inlined = AS_FUNCTION(candidate);
+    }
+  }
+
+  uint8_t argCount = argumentList(parser);
+  // The deepest OP_PEEK reaches past every argument and every temporary.
+  if (inlined != NULL && inlined->arity == argCount &&
+      argCount + INLINE_MAX_SIZE <= UINT8_MAX) {
+    emitInlinedCall(parser, inlined, argCount);
+  } else {
+    emitBytes(parser, OP_CALL, argCount);
+  }
+}
+
+// Evaluates a unary operator on a constant operand at compile time.
+static bool foldUnary(TokenType operatorType, Value operand, Value* result) {
+  switch (operatorType) {
+    case TOKEN_BANG:
+      *result = BOOL_VAL(IS_NIL(operand) ||
+                         (IS_BOOL(operand) && !AS_BOOL(operand)));
+      return true;
+    case TOKEN_MINUS:
+      if (!IS_NUMERIC(operand)) return false; // Leave the error to runtime
+      *result = negateNumber(operand);
+      return true;
+    case TOKEN_TILDE: {
+      int64_t integer;
+      if (!toInteger(operand, &integer)) return false;
+      *result = INT_VAL(~integer);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Evaluates a binary operator on constant operands at compile time,
+// mirroring what the VM would do. Operand types the VM would reject are
+// left alone so the error still happens at runtime.
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value* result) {
+  switch (operatorType) {
+    case TOKEN_EQUAL_EQUAL:
+      *result = BOOL_VAL(valuesEqual(a, b));
+      return true;
+    case TOKEN_BANG_EQUAL:
+      *result = BOOL_VAL(!valuesEqual(a, b));
+      return true;
+    default:
+      break;
+  }
+
+  if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) return false;
+  switch (operatorType) {
+    case TOKEN_PLUS:    *result = addNumbers(a, b); return true;
+    case TOKEN_MINUS:   *result = subtractNumbers(a, b); return true;
+    case TOKEN_STAR:    *result = multiplyNumbers(a, b); return true;
+    case TOKEN_SLASH:   *result = divideNumbers(a, b); return true;
+    case TOKEN_PERCENT: *result = moduloNumbers(a, b); return true;
+    default:            break;
+  }
+
+  int64_t i, j;
+  if (toInteger(a, &i) && toInteger(b, &j)) {
+    switch (operatorType) {
+      case TOKEN_AMPERSAND:       *result = INT_VAL(i & j); return true;
+      case TOKEN_PIPE:            *result = INT_VAL(i | j); return true;
+      case TOKEN_CARET:           *result = INT_VAL(i ^ j); return true;
+      case TOKEN_LESS_LESS:       *result = INT_VAL(shiftLeft(i, j)); return true;
+      case TOKEN_GREATER_GREATER: *result = INT_VAL(shiftRight(i, j)); return true;
+      default:                    break;
+    }
+  }
+
+  // Two integers compare exactly; anything else compares as doubles
+  bool ints = IS_INT(a) && IS_INT(b);
+  bool less = ints ? AS_INT(a) < AS_INT(b) : TO_DOUBLE(a) < TO_DOUBLE(b);
+  bool greater = ints ? AS_INT(a) > AS_INT(b) : TO_DOUBLE(a) > TO_DOUBLE(b);
+  switch (operatorType) {
+    case TOKEN_GREATER:       *result = BOOL_VAL(greater); return true;
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!less); return true;
+    case TOKEN_LESS:          *result = BOOL_VAL(less); return true;
+    case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!greater); return true;
+    default:                  return false;
+  }
 }
 
-static void unary() {
-  TokenType operatorType = parser.previous.type;
-  parsePrecedence(PREC_UNARY);
+static void unary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
+  int operandStart = currentChunk(parser)->count;
+  parsePrecedence(parser, PREC_UNARY);
+
+  Value operand, result;
+  if (constantOperand(parser, operandStart, currentChunk(parser)->count, &operand) &&
+      foldUnary(operatorType, operand, &result)) {
+    discardCode(parser, operandStart);
+    emitValue(parser, result);
+    return;
+  }
+
   switch (operatorType) {
-    case TOKEN_BANG:  emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG:  emitByte(parser, OP_NOT); break;
+    case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
+    case TOKEN_TILDE: emitByte(parser, OP_BIT_NOT); break;
     default: return;
   }
 }
 
-static void binary() {
-  TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
   ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  int leftStart = parser->lastOperandStart;
+  int rightStart = currentChunk(parser)->count;
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+  Value a, b, result;
+  if (leftStart != -1 &&
+      constantOperand(parser, leftStart, rightStart, &a) &&
+      constantOperand(parser, rightStart, currentChunk(parser)->count, &b) &&
+      foldBinary(operatorType, a, b, &result)) {
+    discardCode(parser, leftStart);
+    emitValue(parser, result);
+    return;
+  }
+
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+    case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQUAL, OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+    case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+    case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+    case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
+    case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
+    case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+    case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;
+    case TOKEN_PERCENT:       emitByte(parser, OP_MODULO); break;
+    case TOKEN_AMPERSAND:     emitByte(parser, OP_BIT_AND); break;
+    case TOKEN_PIPE:          emitByte(parser, OP_BIT_OR); break;
+    case TOKEN_CARET:         emitByte(parser, OP_BIT_XOR); break;
+    case TOKEN_LESS_LESS:     emitByte(parser, OP_SHIFT_LEFT); break;
+    case TOKEN_GREATER_GREATER: emitByte(parser, OP_SHIFT_RIGHT); break;
 
     default : return;
   }
 }
 
-static void literal() {
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL:   emitByte(OP_NIL); break;
-    case TOKEN_TRUE:  emitByte(OP_TRUE); break;
+static void literal(Parser* parser, bool canAssign) {
+  switch (parser->previous.type) {
+    case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+    case TOKEN_NIL:   emitByte(parser, OP_NIL); break;
+    case TOKEN_TRUE:  emitByte(parser, OP_TRUE); break;
     default: return;
   }
 }
@@ -451,15 +1216,22 @@ static void literal() {
 ParseRule rules[] = {
   [TOKEN_LEFT_PAREN] =    {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
+  [TOKEN_LEFT_BRACE]    = {map,      NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
   [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
   [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
   [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
+  [TOKEN_PERCENT]       = {NULL,     binary, PREC_FACTOR},
+  [TOKEN_AMPERSAND]     = {NULL,     binary, PREC_BIT_AND},
+  [TOKEN_PIPE]          = {NULL,     binary, PREC_BIT_OR},
+  [TOKEN_CARET]         = {NULL,     binary, PREC_BIT_XOR},
+  [TOKEN_TILDE]         = {unary,    NULL,   PREC_NONE},
   [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
   [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
   [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY},
@@ -467,11 +1239,14 @@ ParseRule rules[] = {
   [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
+  [TOKEN_LESS_LESS]     = {NULL,     binary, PREC_SHIFT},
+  [TOKEN_GREATER_GREATER] = {NULL,   binary, PREC_SHIFT},
   [TOKEN_IDENTIFIER] =    {variable, NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
   [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_CONST]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
@@ -482,7 +1257,7 @@ ParseRule rules[] = {
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_THIS]          = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
   [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
@@ -492,265 +1267,392 @@ ParseRule rules[] = {
 
 static ParseRule* getRule(TokenType type) { return &rules[type]; }
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
-  if (prefixRule == NULL) { error("Expect expression."); return; }
-  prefixRule();
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule();
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
+  if (prefixRule == NULL) { error(parser, "Expect expression."); return; }
+
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  int operandStart = currentChunk(parser)->count;
+  prefixRule(parser, canAssign);
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    parser->lastOperandStart = operandStart;
+    infixRule(parser, canAssign);
+  }
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
   }
 }
 
-static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
+static void expression(Parser* parser) { parsePrecedence(parser, PREC_ASSIGNMENT); }
 
 //STATEMENTS
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(parser, OP_POP);
 }
 
 //Depth of Scope
-static void beginScope() {
-  current->scopeDepth++;
+static void beginScope(Parser* parser) {
+  parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-  current->scopeDepth--;
+static void endScope(Parser* parser) {
+  parser->compiler->scopeDepth--;
 
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth > current->scopeDepth) {
-    emitByte(OP_POP);
-    current->localCount--; // Forget it in the compiler
+  while (parser->compiler->localCount > 0 &&
+         parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+    emitByte(parser, OP_POP);
+    parser->compiler->localCount--; // Forget it in the compiler
   }
 }
 
 //How compiler will handle { and }
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Parser* parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff); // Placeholder 1
-  emitByte(0xff); // Placeholder 2
-  return currentChunk()->count - 2; // Return the index of the placeholder
+static int emitJump(Parser* parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitByte(parser, 0xff); // Placeholder 1
+  emitByte(parser, 0xff); // Placeholder 2
+  return currentChunk(parser)->count - 2; // Return the index of the placeholder
 }
 
-static void patchJump(int offset) {
+static void patchJump(Parser* parser, int offset) {
   // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+  int jump = currentChunk(parser)->count - offset - 2;
 
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    error(parser, "Too much code to jump over.");
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
-    error("Can't return from top-level code.");
+static void returnStatement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
   }
   //Check for "return;" (no value)
-  if (match(TOKEN_SEMICOLON)) {
-    emitReturn(); // Emits OP_NIL then OP_RETURN
+  if (match(parser, TOKEN_SEMICOLON)) {
+    emitReturn(parser); // Emits OP_NIL then OP_RETURN
   } 
   
   else {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+      error(parser, "Can't return a value from an initializer.");
+    }
     //Parse "return value;"
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emitByte(parser, OP_RETURN);
   }
 
 }
 
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
+static void ifStatement(Parser* parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP); // Pop the condition value from stack
-  statement();
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP); // Pop the condition value from stack
+  statement(parser);
 
-  int elseJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(parser, OP_JUMP);
 
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
 
-  if (match(TOKEN_ELSE)) {
-    statement();
+  if (match(parser, TOKEN_ELSE)) {
+    statement(parser);
   }
   
-  patchJump(elseJump);
+  patchJump(parser, elseJump);
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk(parser)->count - loopStart + 2;
+  if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
 }
 
-static void whileStatement() {
-  int loopStart = currentChunk()->count; //Mark the start
+static void whileStatement(Parser* parser) {
+  int loopStart = currentChunk(parser)->count; //Mark the start
   
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE); //Jump out if false
-  emitByte(OP_POP);
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE); //Jump out if false
+  emitByte(parser, OP_POP);
   
-  statement(); //Compile body
+  statement(parser); //Compile body
 
-  emitLoop(loopStart);
+  emitLoop(parser, loopStart);
 
-  patchJump(exitJump);
-  emitByte(OP_POP);
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-  beginScope(); // A for loop gets its own scope for variables like 'i'
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+static void forStatement(Parser* parser) {
+  beginScope(parser); // A for loop gets its own scope for variables like 'i'
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
   // 1. Initializer
-  if (match(TOKEN_SEMICOLON)) {
+  if (match(parser, TOKEN_SEMICOLON)) {
     // No initializer: for (; ...)
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 
-  int loopStart = currentChunk()->count;
+  int loopStart = currentChunk(parser)->count;
 
   // 2. Condition
   int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
     // Jump out of the loop if the condition is false
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
   }
 
   // 3. Increment
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP); // Jump over the increment
-    int incrementStart = currentChunk()->count;
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(parser, OP_JUMP); // Jump over the increment
+    int incrementStart = currentChunk(parser)->count;
     
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-    emitLoop(loopStart); // After increment, loop back to start/condition
+    emitLoop(parser, loopStart); // After increment, loop back to start/condition
     loopStart = incrementStart; // Next time, loop back to increment, not start
-    patchJump(bodyJump);
+    patchJump(parser, bodyJump);
   }
 
   // 4. Body
-  statement();
-  emitLoop(loopStart); // Loop back to start (or increment)
+  statement(parser);
+  emitLoop(parser, loopStart); // Loop back to start (or increment)
 
   if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
   }
 
-  endScope();
+  endScope(parser);
 }
 
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
+static void statement(Parser* parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
   }
 
-  else if (match(TOKEN_IF)) {
-    ifStatement();
+  else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
   }
 
-  else if (match(TOKEN_RETURN)) {
-    returnStatement();
+  else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
   }
 
-  else if (match(TOKEN_FOR)){
-    forStatement();
+  else if (match(parser, TOKEN_FOR)){
+    forStatement(parser);
   }
 
-  else if (match(TOKEN_WHILE)){
-    whileStatement();
+  else if (match(parser, TOKEN_WHILE)){
+    whileStatement(parser);
   }
 
-  else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
+  else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
   }
 
-  else expressionStatement();
+  else expressionStatement(parser);
 }
 
 //Initialize the compiler
-static void initCompiler(Compiler* compiler, FunctionType type) {
-  compiler->enclosing = current; //Save the previous compiler
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type) {
+  compiler->enclosing = parser->compiler; //Save the previous compiler
   compiler->function = NULL;
   compiler->type = type;
   
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
+  compiler->function = newFunction(parser->vm);
   
-  current = compiler; //switch to the new one
+  parser->compiler = compiler; //switch to the new one
 
   if (type != TYPE_SCRIPT) {
-    compiler->function->name = copyString(parser.previous.start, parser.previous.length);
+    compiler->function->name = copyString(parser->vm, parser->previous.start, parser->previous.length);
   }
 
+  // Slot zero holds the callee, or the receiver in a method
   Local* local = &compiler->locals[compiler->localCount++];
   local->depth = 0;
-  local->name.start = "";
-  local->name.length = 0;
+  local->isCaptured = false;
+  local->isConst = false;
+  local->isFolded = false;
+  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+    local->name.start = "this";
+    local->name.length = 4;
+  } else {
+    local->name.start = "";
+    local->name.length = 0;
+  }
+}
+
+static void initParser(Parser* parser, VM* vm, const char* source,
+                       size_t length, int line) {
+  parser->vm = vm;
+  initScanner(&parser->scanner, source, length, line);
+  parser->hadError = false;
+  parser->panicMode = false;
+  parser->compiler = NULL;
+  parser->currentClass = NULL;
+  initTable(&parser->inlineCandidates);
+  initTable(&parser->constNames);
+  initTable(&parser->constValues);
+  parser->lastGlobalGet = -1;
+  parser->lastOperandStart = -1;
+}
+
+static void freeParser(Parser* parser) {
+  freeTable(parser->vm, &parser->inlineCandidates);
+  freeTable(parser->vm, &parser->constNames);
+  freeTable(parser->vm, &parser->constValues);
 }
 
 //Compile Entry Point
-ObjFunction* compile(const char* source) {
-  initScanner(source);
+ObjFunction* compile(VM* vm, const char* source, size_t length, int line) {
+  Parser parser;
+  initParser(&parser, vm, source, length, line);
   
   Compiler compiler;
   // Initialize the compiler as a "Script" (the main body of code)
-  initCompiler(&compiler, TYPE_SCRIPT);
-
-  parser.hadError = false;
-  parser.panicMode = false;
-  advance();
+  initCompiler(&parser, &compiler, TYPE_SCRIPT);
+  advance(&parser);
 
-  while (!match(TOKEN_EOF)) {
-    declaration();
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);
   }
 
   // Using the new endCompiler() which returns the function object
-  ObjFunction* function = endCompiler();
+  ObjFunction* function = endCompiler(&parser);
+  if (!parser.hadError) {
+    tableAddAll(vm, &parser.constNames, &vm->constNames);
+    tableAddAll(vm, &parser.constValues, &vm->constValues);
+  }
+  freeParser(&parser);
   return parser.hadError ? NULL : function;
-}
\ No newline at end of file
+}
+
+// True if a token can begin a new declaration but can't continue the
+// expression or statement before it.
+static bool startsDeclaration(TokenType type) {
+  switch (type) {
+    case TOKEN_IDENTIFIER: case TOKEN_STRING: case TOKEN_NUMBER:
+    case TOKEN_LEFT_BRACE: case TOKEN_CLASS: case TOKEN_CONST:
+    case TOKEN_FALSE: case TOKEN_FOR: case TOKEN_FUN: case TOKEN_IF:
+    case TOKEN_NIL: case TOKEN_PRINT: case TOKEN_RETURN: case TOKEN_SUPER:
+    case TOKEN_THIS: case TOKEN_TRUE: case TOKEN_VAR: case TOKEN_WHILE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Streaming mode: returns the length of the longest prefix of 'source'
+// made of whole top-level declarations, so it can be compiled before the
+// rest has arrived. A declaration ends at a ';' or '}' outside any
+// parentheses or braces, and only counts once the token after it has
+// been seen in full (it could be an 'else').
+size_t completeDeclarations(const char* source, size_t length) {
+  Scanner scanner;
+  initScanner(&scanner, source, length, 1);
+  const char* end = source + length;
+  size_t complete = 0;
+  int depth = 0;
+  TokenType previous = TOKEN_EOF;
+
+  for (;;) {
+    Token token = scanToken(&scanner);
+    if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR) break;
+    // The last token may be cut short by the end of the chunk
+    if (token.start + token.length >= end) break;
+
+    if (depth == 0 &&
+        ((previous == TOKEN_SEMICOLON && token.type != TOKEN_ELSE) ||
+         (previous == TOKEN_RIGHT_BRACE && startsDeclaration(token.type)))) {
+      complete = (size_t)(token.start - source);
+    }
+
+    switch (token.type) {
+      case TOKEN_LEFT_PAREN: case TOKEN_LEFT_BRACE: case TOKEN_LEFT_BRACKET:
+        depth++;
+        break;
+      case TOKEN_RIGHT_PAREN: case TOKEN_RIGHT_BRACE: case TOKEN_RIGHT_BRACKET:
+        depth--;
+        break;
+      default: break;
+    }
+    previous = token.type;
+  }
+  return complete;
+}
+
+// Compiles a stub created by lazyFunction() in place. Lazy bodies never
+// capture locals, so they are compiled as if declared at the top level.
+bool compileLazyFunction(VM* vm, ObjFunction* function) {
+  Parser parser;
+  initParser(&parser, vm, function->lazySource, function->lazyLength, function->lazyLine);
+  // advance() moves the name into 'previous', where initCompiler() looks
+  parser.current.type = TOKEN_IDENTIFIER;
+  parser.current.start = function->name->chars;
+  parser.current.length = function->name->length;
+  parser.current.line = function->lazyLine;
+  advance(&parser);
+
+  Compiler compiler;
+  ObjFunction* compiled = functionBody(&parser, &compiler, TYPE_FUNCTION);
+  freeParser(&parser);
+  if (parser.hadError) return false;
+
+  freeChunk(vm, &function->chunk);
+  function->chunk = compiled->chunk;
+  function->upvalueCount = compiled->upvalueCount;
+  function->maxSlots = compiled->maxSlots;
+  initChunk(&compiled->chunk);
+
+  FREE_ARRAY(vm, char, function->lazySource, function->lazyLength + 1);
+  function->lazySource = NULL;
+  function->lazyLength = 0;
+  return true;
+}
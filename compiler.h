@@ -6,6 +6,16 @@
 #include "vm.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
+typedef struct {
+  bool lazyFunctions; // Skim function bodies now, compile them on first call
+  bool inlineCalls;   // Inline calls to small global functions
+} CompilerOptions;
+
+// Set once at startup and shared by every VM in the process
+extern CompilerOptions compilerOptions;
+
+ObjFunction* compile(VM* vm, const char* source, size_t length, int line);
+bool compileLazyFunction(VM* vm, ObjFunction* function);
+size_t completeDeclarations(const char* source, size_t length);
 
 #endif
\ No newline at end of file
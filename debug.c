@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "debug.h"
+#include "object.h"
 #include "value.h"
 
 
@@ -50,6 +51,28 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
   return offset + 3;
 }
 
+// A name constant followed by a 16-bit inline cache index
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) |
+                              chunk->code[offset + 3]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) |
+                              chunk->code[offset + 4]);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   uint8_t slot = chunk->code[offset + 1];
   printf("%-16s %4d\n", name, slot);
@@ -73,8 +96,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
       return simpleInstruction("OP_DIVIDE", offset);
+    case OP_MODULO:
+      return simpleInstruction("OP_MODULO", offset);
+    case OP_BIT_AND:
+      return simpleInstruction("OP_BIT_AND", offset);
+    case OP_BIT_OR:
+      return simpleInstruction("OP_BIT_OR", offset);
+    case OP_BIT_XOR:
+      return simpleInstruction("OP_BIT_XOR", offset);
+    case OP_SHIFT_LEFT:
+      return simpleInstruction("OP_SHIFT_LEFT", offset);
+    case OP_SHIFT_RIGHT:
+      return simpleInstruction("OP_SHIFT_RIGHT", offset);
     case OP_NEGATE:
       return simpleInstruction("OP_NEGATE", offset);
+    case OP_BIT_NOT:
+      return simpleInstruction("OP_BIT_NOT", offset);
 
     case OP_POP:
       return simpleInstruction("OP_POP", offset);
@@ -101,12 +138,48 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return constantInstruction("OP_SET_GLOBAL", chunk, offset);
 
     case OP_GET_LOCAL:
-      return constantInstruction("OP_GET_LOCAL", chunk, offset); // Note: It uses a byte operand
+      return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
-      return constantInstruction("OP_SET_LOCAL", chunk, offset);
+      return byteInstruction("OP_SET_LOCAL", chunk, offset);
 
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_PEEK:
+      return byteInstruction("OP_PEEK", chunk, offset);
+    case OP_INLINE_GUARD: {
+      uint8_t argCount = chunk->code[offset + 1];
+      uint8_t constant = chunk->code[offset + 2];
+      uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+      jump |= chunk->code[offset + 4];
+      printf("%-16s %4d %4d '", "OP_INLINE_GUARD", argCount, constant);
+      printValue(chunk->constants.values[constant]);
+      printf("' -> %d\n", offset + 5 + jump);
+      return offset + 5;
+    }
+    case OP_INLINE_RETURN:
+      return byteInstruction("OP_INLINE_RETURN", chunk, offset);
+    case OP_BUILD_LIST:
+      return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    case OP_LIST_APPEND:
+      return simpleInstruction("OP_LIST_APPEND", offset);
+    case OP_INDEX_GET:
+      return simpleInstruction("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:
+      return simpleInstruction("OP_INDEX_SET", offset);
+    case OP_BUILD_MAP:
+      return byteInstruction("OP_BUILD_MAP", chunk, offset);
+    case OP_MAP_INSERT:
+      return simpleInstruction("OP_MAP_INSERT", offset);
+    case OP_CLASS:
+      return constantInstruction("OP_CLASS", chunk, offset);
+    case OP_METHOD:
+      return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_GET_PROPERTY:
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+    case OP_SET_PROPERTY:
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+    case OP_INVOKE:
+      return invokeInstruction("OP_INVOKE", chunk, offset);
 
     case OP_JUMP:
       return jumpInstruction("OP_JUMP", 1, chunk, offset);
@@ -118,6 +191,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
     case OP_CONSTANT:
       return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CLOSURE: {
+      uint8_t constant = chunk->code[offset + 1];
+      printf("%-16s %4d ", "OP_CLOSURE", constant);
+      printValue(chunk->constants.values[constant]);
+      printf("\n");
+      // Each upvalue adds an (isLocal, index) byte pair.
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+      return offset + 2 + function->upvalueCount * 2;
+    }
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
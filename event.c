@@ -0,0 +1,448 @@
+#define _GNU_SOURCE // accept4()
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "vm.h"
+
+#define READ_CHUNK (64 * 1024)
+#define EVENTS_MAX 64
+
+// What the loop knows about one file descriptor. At most one reader and
+// one writer wait on it at a time.
+typedef struct {
+  bool known;       // Looked at since it was opened
+  bool nonBlocking; // Safe to try without waiting for readiness first
+  bool registered;  // In the epoll set, armed or not
+  Waiter* reader;   // WAIT_READ or WAIT_ACCEPT
+  Waiter* writer;   // WAIT_WRITE or WAIT_CONNECT
+} FdState;
+
+struct EventLoop {
+  int epoll;
+  FdState* fds; // Indexed by fd
+  int fdCapacity;
+  Waiter** timers; // Min-heap on deadline
+  int timerCount;
+  int timerCapacity;
+  Waiter* firstReady;
+  Waiter* lastReady;
+  int pending; // Started and not yet finished
+  char* readBuffer;
+};
+
+static int64_t now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (int64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+static EventLoop* loopOf(VM* vm) {
+  if (vm->events != NULL) return vm->events;
+
+  EventLoop* loop = malloc(sizeof(EventLoop));
+  if (loop == NULL) exit(1);
+  loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll < 0) exit(1);
+  loop->fds = NULL;
+  loop->fdCapacity = 0;
+  loop->timers = NULL;
+  loop->timerCount = 0;
+  loop->timerCapacity = 0;
+  loop->firstReady = NULL;
+  loop->lastReady = NULL;
+  loop->pending = 0;
+  loop->readBuffer = malloc(READ_CHUNK);
+  if (loop->readBuffer == NULL) exit(1);
+  vm->events = loop;
+  return loop;
+}
+
+// 'fd' must be open, which keeps it below the descriptor limit
+static FdState* fdSlot(EventLoop* loop, int fd) {
+  if (fd >= loop->fdCapacity) {
+    int capacity = loop->fdCapacity < 64 ? 64 : loop->fdCapacity;
+    while (capacity <= fd) {
+      capacity = capacity > INT_MAX / 2 ? INT_MAX : capacity * 2;
+    }
+    loop->fds = realloc(loop->fds, sizeof(FdState) * capacity);
+    if (loop->fds == NULL) exit(1);
+    memset(loop->fds + loop->fdCapacity, 0,
+           sizeof(FdState) * (capacity - loop->fdCapacity));
+    loop->fdCapacity = capacity;
+  }
+  return &loop->fds[fd];
+}
+
+static FdState* fdState(EventLoop* loop, int fd) {
+  FdState* state = fdSlot(loop, fd);
+  if (!state->known) {
+    // Descriptors from outside keep their mode. A blocking one is only
+    // touched once epoll says it is ready.
+    int flags = fcntl(fd, F_GETFL);
+    state->known = true;
+    state->nonBlocking = flags >= 0 && (flags & O_NONBLOCK);
+  }
+  return state;
+}
+
+// For the sockets opened here, which are non-blocking from the start
+static void ownFd(EventLoop* loop, int fd) {
+  FdState* state = fdSlot(loop, fd);
+  state->known = true;
+  state->nonBlocking = true;
+}
+
+Waiter* newWaiter(WaitKind kind, int fd) {
+  Waiter* waiter = malloc(sizeof(Waiter));
+  if (waiter == NULL) exit(1);
+  waiter->kind = kind;
+  waiter->fd = fd;
+  waiter->chars = NULL;
+  waiter->length = 0;
+  waiter->written = 0;
+  waiter->deadline = 0;
+  waiter->result = NIL_VAL;
+  waiter->fiber = NULL;
+  waiter->frameCount = 0;
+  waiter->stackTop = NULL;
+  waiter->next = NULL;
+  return waiter;
+}
+
+static void makeReady(EventLoop* loop, Waiter* waiter) {
+  waiter->next = NULL;
+  if (loop->lastReady == NULL) loop->firstReady = waiter;
+  else loop->lastReady->next = waiter;
+  loop->lastReady = waiter;
+}
+
+// --- Timers ---
+
+static bool timerBefore(Waiter* a, Waiter* b) {
+  return a->deadline < b->deadline;
+}
+
+static void addTimer(EventLoop* loop, Waiter* waiter) {
+  if (loop->timerCount == loop->timerCapacity) {
+    loop->timerCapacity = loop->timerCapacity < 16 ? 16 : loop->timerCapacity * 2;
+    loop->timers = realloc(loop->timers, sizeof(Waiter*) * loop->timerCapacity);
+    if (loop->timers == NULL) exit(1);
+  }
+  int i = loop->timerCount++;
+  while (i > 0 && timerBefore(waiter, loop->timers[(i - 1) / 2])) {
+    loop->timers[i] = loop->timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  loop->timers[i] = waiter;
+}
+
+static Waiter* popTimer(EventLoop* loop) {
+  Waiter* first = loop->timers[0];
+  Waiter* last = loop->timers[--loop->timerCount];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= loop->timerCount) break;
+    if (child + 1 < loop->timerCount &&
+        timerBefore(loop->timers[child + 1], loop->timers[child])) {
+      child++;
+    }
+    if (!timerBefore(loop->timers[child], last)) break;
+    loop->timers[i] = loop->timers[child];
+    i = child;
+  }
+  if (loop->timerCount > 0) loop->timers[i] = last;
+  return first;
+}
+
+// --- File descriptors ---
+
+// Tries the operation once. True if it is finished, one way or another.
+static bool attempt(VM* vm, EventLoop* loop, Waiter* waiter) {
+  int fd = waiter->fd;
+  switch (waiter->kind) {
+    case WAIT_READ: {
+      ssize_t count = read(fd, loop->readBuffer, READ_CHUNK);
+      if (count < 0 && (errno == EAGAIN || errno == EINTR)) return false;
+      // nil at end of file, or on an error
+      waiter->result = count > 0
+          ? OBJ_VAL(copyString(vm, loop->readBuffer, (int)count))
+          : NIL_VAL;
+      return true;
+    }
+    case WAIT_WRITE: {
+      while (waiter->written < waiter->length) {
+        ssize_t count = write(fd, waiter->chars + waiter->written,
+                              waiter->length - waiter->written);
+        if (count < 0 && (errno == EAGAIN || errno == EINTR)) return false;
+        if (count < 0) {
+          waiter->result = NIL_VAL;
+          return true;
+        }
+        waiter->written += (int)count;
+        // A blocking descriptor was only promised room for one write
+        if (!fdState(loop, fd)->nonBlocking) break;
+      }
+      if (waiter->written < waiter->length) return false;
+      waiter->result = INT_VAL(waiter->length);
+      return true;
+    }
+    case WAIT_ACCEPT: {
+      int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client < 0 && (errno == EAGAIN || errno == EINTR ||
+                         errno == ECONNABORTED)) {
+        return false;
+      }
+      if (client >= 0) ownFd(loop, client);
+      waiter->result = client < 0 ? NIL_VAL : INT_VAL(client);
+      return true;
+    }
+    case WAIT_CONNECT: {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      bool connected =
+          getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 &&
+          error == 0;
+      // dispatch() closes the socket if this failed
+      waiter->result = connected ? INT_VAL(fd) : NIL_VAL;
+      return true;
+    }
+    case WAIT_SLEEP:
+      break;
+  }
+  return true;
+}
+
+// Points the epoll registration for 'fd' at whoever is waiting on it.
+// Registrations are one-shot, so a descriptor nobody waits on stays
+// quiet without a syscall to remove it.
+static bool arm(EventLoop* loop, int fd) {
+  FdState* state = &loop->fds[fd];
+  struct epoll_event event;
+  event.events = EPOLLONESHOT;
+  if (state->reader != NULL) event.events |= EPOLLIN;
+  if (state->writer != NULL) event.events |= EPOLLOUT;
+  event.data.fd = fd;
+
+  if (state->registered) {
+    return epoll_ctl(loop->epoll, EPOLL_CTL_MOD, fd, &event) == 0;
+  }
+  if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event) != 0) return false;
+  state->registered = true;
+  return true;
+}
+
+bool startWait(VM* vm, Waiter* waiter) {
+  EventLoop* loop = loopOf(vm);
+
+  if (waiter->kind == WAIT_SLEEP) {
+    waiter->deadline += now();
+    addTimer(loop, waiter);
+    loop->pending++;
+    return true;
+  }
+
+  int fd = waiter->fd;
+  if (fcntl(fd, F_GETFD) == -1) {
+    waiter->result = NIL_VAL; // Not open
+    return false;
+  }
+  FdState* state = fdState(loop, fd);
+  bool reads = waiter->kind == WAIT_READ || waiter->kind == WAIT_ACCEPT;
+  Waiter** slot = reads ? &state->reader : &state->writer;
+  if (*slot != NULL) {
+    waiter->result = NIL_VAL; // Someone is already waiting for the same
+    return false;
+  }
+
+  if (state->nonBlocking && waiter->kind != WAIT_CONNECT &&
+      attempt(vm, loop, waiter)) {
+    return false;
+  }
+
+  *slot = waiter;
+  if (!arm(loop, fd)) {
+    *slot = NULL;
+    // Regular files can't be polled; they never make a reader wait long
+    if (errno == EPERM) {
+      while (!attempt(vm, loop, waiter)) {}
+    } else {
+      waiter->result = NIL_VAL;
+    }
+    return false;
+  }
+  loop->pending++;
+  return true;
+}
+
+static void finish(EventLoop* loop, Waiter** slot) {
+  Waiter* waiter = *slot;
+  *slot = NULL;
+  loop->pending--;
+  makeReady(loop, waiter);
+}
+
+static void dispatch(VM* vm, EventLoop* loop, struct epoll_event* event) {
+  int fd = event->data.fd;
+  FdState* state = &loop->fds[fd];
+  bool failed = event->events & (EPOLLERR | EPOLLHUP);
+
+  if (state->reader != NULL && (event->events & EPOLLIN || failed) &&
+      attempt(vm, loop, state->reader)) {
+    finish(loop, &state->reader);
+  }
+  if (state->writer != NULL && (event->events & EPOLLOUT || failed) &&
+      attempt(vm, loop, state->writer)) {
+    bool refused = state->writer->kind == WAIT_CONNECT &&
+                   IS_NIL(state->writer->result);
+    finish(loop, &state->writer);
+    if (refused) {
+      closeFd(vm, fd);
+      return;
+    }
+  }
+  if (state->reader != NULL || state->writer != NULL) arm(loop, fd);
+}
+
+Waiter* nextReady(VM* vm) {
+  EventLoop* loop = vm->events;
+  if (loop == NULL) return NULL;
+
+  while (loop->firstReady == NULL) {
+    if (loop->pending == 0) return NULL;
+
+    int timeout = -1;
+    if (loop->timerCount > 0) {
+      int64_t wait = loop->timers[0]->deadline - now();
+      timeout = wait < 0 ? 0 : (wait > INT32_MAX ? INT32_MAX : (int)wait);
+    }
+
+    struct epoll_event events[EVENTS_MAX];
+    int count = epoll_wait(loop->epoll, events, EVENTS_MAX, timeout);
+    for (int i = 0; i < count; i++) dispatch(vm, loop, &events[i]);
+
+    int64_t time = now();
+    while (loop->timerCount > 0 && loop->timers[0]->deadline <= time) {
+      loop->pending--;
+      makeReady(loop, popTimer(loop));
+    }
+  }
+
+  Waiter* waiter = loop->firstReady;
+  loop->firstReady = waiter->next;
+  if (loop->firstReady == NULL) loop->lastReady = NULL;
+  return waiter;
+}
+
+bool closeFd(VM* vm, int fd) {
+  EventLoop* loop = vm->events;
+  if (loop != NULL && fd < loop->fdCapacity) {
+    FdState* state = &loop->fds[fd];
+    if (state->reader != NULL) finish(loop, &state->reader);
+    if (state->writer != NULL) finish(loop, &state->writer);
+    // Closing drops the epoll registration along with the descriptor
+    memset(state, 0, sizeof(FdState));
+  }
+  return close(fd) == 0;
+}
+
+// --- Sockets ---
+
+static bool socketAddress(const char* host, int port, struct sockaddr_in* address) {
+  if (port < 0 || port > 65535) return false;
+  memset(address, 0, sizeof(*address));
+  address->sin_family = AF_INET;
+  address->sin_port = htons((uint16_t)port);
+  return inet_pton(AF_INET, host, &address->sin_addr) == 1;
+}
+
+static int openSocket(VM* vm) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0) ownFd(loopOf(vm), fd);
+  return fd;
+}
+
+int listenOn(VM* vm, const char* host, int port) {
+  struct sockaddr_in address;
+  if (!socketAddress(host, port, &address)) return -1;
+
+  int fd = openSocket(vm);
+  if (fd < 0) return -1;
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    closeFd(vm, fd);
+    return -1;
+  }
+  return fd;
+}
+
+int connectTo(VM* vm, const char* host, int port) {
+  struct sockaddr_in address;
+  if (!socketAddress(host, port, &address)) return -1;
+
+  int fd = openSocket(vm);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 &&
+      errno != EINPROGRESS) {
+    closeFd(vm, fd);
+    return -1;
+  }
+  return fd;
+}
+
+int localPort(int fd) {
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (getsockname(fd, (struct sockaddr*)&address, &length) != 0 ||
+      address.sin_family != AF_INET) {
+    return -1;
+  }
+  return ntohs(address.sin_port);
+}
+
+void cancelWaits(VM* vm) {
+  EventLoop* loop = vm->events;
+  if (loop == NULL) return;
+
+  for (int fd = 0; fd < loop->fdCapacity; fd++) {
+    FdState* state = &loop->fds[fd];
+    free(state->reader);
+    free(state->writer);
+    state->reader = NULL;
+    state->writer = NULL;
+  }
+  for (int i = 0; i < loop->timerCount; i++) free(loop->timers[i]);
+  loop->timerCount = 0;
+  while (loop->firstReady != NULL) {
+    Waiter* next = loop->firstReady->next;
+    free(loop->firstReady);
+    loop->firstReady = next;
+  }
+  loop->lastReady = NULL;
+  loop->pending = 0;
+}
+
+void freeEvents(VM* vm) {
+  EventLoop* loop = vm->events;
+  if (loop == NULL) return;
+
+  cancelWaits(vm);
+  close(loop->epoll);
+  free(loop->fds);
+  free(loop->timers);
+  free(loop->readBuffer);
+  free(loop);
+  vm->events = NULL;
+}
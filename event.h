@@ -0,0 +1,65 @@
+#ifndef asharp_event_h
+#define asharp_event_h
+
+#include "common.h"
+#include "object.h"
+
+// An epoll event loop, one per VM. A fiber or the main script that asks
+// for I/O that isn't ready, or for a timer, is parked on a Waiter; the
+// VM runs something else, and switches back once the loop reports the
+// waiter finished (see schedule() in vm.c).
+
+typedef struct EventLoop EventLoop;
+
+typedef enum {
+  WAIT_SLEEP,
+  WAIT_READ,
+  WAIT_WRITE,
+  WAIT_ACCEPT,
+  WAIT_CONNECT,
+} WaitKind;
+
+typedef struct Waiter {
+  WaitKind kind;
+  int fd;
+  const char* chars; // WAIT_WRITE: what is left to write
+  int length;
+  int written;
+  int64_t deadline;  // WAIT_SLEEP: the delay in ms, and once started the
+                     // time it ends on the monotonic clock
+  Value result;      // Set once finished
+
+  // Where the parked code stopped: the fiber (NULL for the main script)
+  // and how its stack stood
+  ObjFiber* fiber;
+  int frameCount;
+  Value* stackTop;
+
+  struct Waiter* next; // In the ready queue
+} Waiter;
+
+Waiter* newWaiter(WaitKind kind, int fd);
+
+// Starts the waiter's operation. Returns false if it finished at once,
+// with 'result' set; true if the caller must park until nextReady()
+// hands it back.
+bool startWait(VM* vm, Waiter* waiter);
+
+// The next finished waiter, blocking until one is. NULL if nothing is
+// left waiting.
+Waiter* nextReady(VM* vm);
+
+// Wakes anything waiting on 'fd' with nil, then closes it
+bool closeFd(VM* vm, int fd);
+
+// Non-blocking TCP sockets on a dotted IPv4 address; -1 on failure. A
+// connection may still be in progress: wait on it with WAIT_CONNECT.
+int listenOn(VM* vm, const char* host, int port);
+int connectTo(VM* vm, const char* host, int port);
+int localPort(int fd);
+
+// Drops every waiter, after a runtime error has reset the stacks
+void cancelWaits(VM* vm);
+void freeEvents(VM* vm);
+
+#endif
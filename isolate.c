@@ -0,0 +1,453 @@
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "isolate.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// --- Messages ---
+
+// A value flattened into bytes, so it belongs to no heap on the way
+typedef struct Message {
+  _Atomic(struct Message*) next;
+  size_t length;
+  uint8_t bytes[];
+} Message;
+
+typedef enum {
+  MESSAGE_NIL, MESSAGE_FALSE, MESSAGE_TRUE, MESSAGE_NUMBER, MESSAGE_INT,
+  MESSAGE_STRING, MESSAGE_LIST, MESSAGE_MAP, MESSAGE_FLOAT_ARRAY,
+} MessageTag;
+
+// Lists and maps nested deeper than this (or inside themselves) can't be sent
+#define MESSAGE_MAX_DEPTH 64
+
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} Encoder;
+
+static void encodeBytes(Encoder* encoder, const void* bytes, size_t length) {
+  if (encoder->count + length > encoder->capacity) {
+    size_t capacity = encoder->capacity < 64 ? 64 : encoder->capacity * 2;
+    while (capacity < encoder->count + length) capacity *= 2;
+    encoder->bytes = realloc(encoder->bytes, capacity);
+    if (encoder->bytes == NULL) exit(1);
+    encoder->capacity = capacity;
+  }
+  memcpy(encoder->bytes + encoder->count, bytes, length);
+  encoder->count += length;
+}
+
+static void encodeTag(Encoder* encoder, MessageTag tag) {
+  uint8_t byte = (uint8_t)tag;
+  encodeBytes(encoder, &byte, 1);
+}
+
+static void encodeCount(Encoder* encoder, int count) {
+  encodeBytes(encoder, &count, sizeof(count));
+}
+
+static bool encodeValue(Encoder* encoder, Value value, int depth) {
+  if (depth > MESSAGE_MAX_DEPTH) return false;
+
+  if (IS_NIL(value)) {
+    encodeTag(encoder, MESSAGE_NIL);
+  } else if (IS_BOOL(value)) {
+    encodeTag(encoder, AS_BOOL(value) ? MESSAGE_TRUE : MESSAGE_FALSE);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    encodeTag(encoder, MESSAGE_NUMBER);
+    encodeBytes(encoder, &number, sizeof(number));
+  } else if (IS_INT(value)) {
+    int64_t integer = AS_INT(value);
+    encodeTag(encoder, MESSAGE_INT);
+    encodeBytes(encoder, &integer, sizeof(integer));
+  } else if (IS_STRING_LIKE(value)) {
+    // Slices arrive as plain strings; their parent stays behind
+    encodeTag(encoder, MESSAGE_STRING);
+    encodeCount(encoder, STRING_LENGTH(value));
+    encodeBytes(encoder, STRING_CHARS(value), STRING_LENGTH(value));
+  } else if (IS_LIST(value)) {
+    ValueArray* items = &AS_LIST(value)->items;
+    encodeTag(encoder, MESSAGE_LIST);
+    encodeCount(encoder, items->count);
+    for (int i = 0; i < items->count; i++) {
+      if (!encodeValue(encoder, items->values[i], depth + 1)) return false;
+    }
+  } else if (IS_MAP(value)) {
+    Table* table = &AS_MAP(value)->table;
+    encodeTag(encoder, MESSAGE_MAP);
+    encodeCount(encoder, table->count);
+    for (int i = 0; i < table->capacity; i++) {
+      Entry* entry = &table->entries[i];
+      if (IS_NIL(entry->key)) continue;
+      if (!encodeValue(encoder, entry->key, depth + 1) ||
+          !encodeValue(encoder, entry->value, depth + 1)) {
+        return false;
+      }
+    }
+  } else if (IS_FLOAT_ARRAY(value)) {
+    ObjFloatArray* array = AS_FLOAT_ARRAY(value);
+    encodeTag(encoder, MESSAGE_FLOAT_ARRAY);
+    encodeCount(encoder, array->count);
+    encodeBytes(encoder, array->values, sizeof(double) * array->count);
+  } else {
+    return false; // Functions, classes and instances stay in their heap
+  }
+  return true;
+}
+
+static void decodeBytes(const uint8_t** cursor, void* bytes, size_t length) {
+  memcpy(bytes, *cursor, length);
+  *cursor += length;
+}
+
+static int decodeCount(const uint8_t** cursor) {
+  int count;
+  decodeBytes(cursor, &count, sizeof(count));
+  return count;
+}
+
+// Every object made here is reachable only from the C stack, which is
+// safe because nothing is freed before the VM is.
+static Value decodeValue(VM* vm, const uint8_t** cursor) {
+  MessageTag tag = (MessageTag)*(*cursor)++;
+  switch (tag) {
+    case MESSAGE_NIL: return NIL_VAL;
+    case MESSAGE_FALSE: return BOOL_VAL(false);
+    case MESSAGE_TRUE: return BOOL_VAL(true);
+    case MESSAGE_NUMBER: {
+      double number;
+      decodeBytes(cursor, &number, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case MESSAGE_INT: {
+      int64_t integer;
+      decodeBytes(cursor, &integer, sizeof(integer));
+      return INT_VAL(integer);
+    }
+    case MESSAGE_STRING: {
+      int length = decodeCount(cursor);
+      ObjString* string = copyString(vm, (const char*)*cursor, length);
+      *cursor += length;
+      return OBJ_VAL(string);
+    }
+    case MESSAGE_LIST: {
+      int count = decodeCount(cursor);
+      ObjList* list = newList(vm);
+      for (int i = 0; i < count; i++) {
+        writeValueArray(vm, &list->items, decodeValue(vm, cursor));
+      }
+      return OBJ_VAL(list);
+    }
+    case MESSAGE_MAP: {
+      int count = decodeCount(cursor);
+      ObjMap* map = newMap(vm);
+      for (int i = 0; i < count; i++) {
+        Value key = decodeValue(vm, cursor);
+        Value value = decodeValue(vm, cursor);
+        tableSetValue(vm, &map->table, key, value);
+      }
+      return OBJ_VAL(map);
+    }
+    case MESSAGE_FLOAT_ARRAY: {
+      int count = decodeCount(cursor);
+      ObjFloatArray* array = newFloatArray(vm, count);
+      decodeBytes(cursor, array->values, sizeof(double) * count);
+      return OBJ_VAL(array);
+    }
+  }
+  return NIL_VAL; // Unreachable
+}
+
+// --- Mailboxes ---
+
+// Vyukov's multi-producer, single-consumer queue. Senders swap 'head' to
+// their message and then link the one before it; only the owner moves
+// 'tail'. The node at 'tail' has already been received (at first, an
+// empty stub), so neither end is ever NULL and no sender takes a lock.
+typedef struct {
+  _Atomic(Message*) head;
+  Message* tail;
+  sem_t waiting; // Messages sent and not yet received
+} Mailbox;
+
+static Message* newMessage(size_t length) {
+  Message* message = malloc(sizeof(Message) + length);
+  if (message == NULL) exit(1);
+  atomic_init(&message->next, NULL);
+  message->length = length;
+  return message;
+}
+
+static void initMailbox(Mailbox* mailbox) {
+  Message* stub = newMessage(0);
+  atomic_init(&mailbox->head, stub);
+  mailbox->tail = stub;
+  sem_init(&mailbox->waiting, 0, 0);
+}
+
+static void freeMailbox(Mailbox* mailbox) {
+  Message* message = mailbox->tail;
+  while (message != NULL) {
+    Message* next = atomic_load_explicit(&message->next, memory_order_relaxed);
+    free(message);
+    message = next;
+  }
+  sem_destroy(&mailbox->waiting);
+}
+
+static void post(Mailbox* mailbox, Message* message) {
+  Message* previous = atomic_exchange_explicit(&mailbox->head, message,
+                                               memory_order_acq_rel);
+  atomic_store_explicit(&previous->next, message, memory_order_release);
+  sem_post(&mailbox->waiting);
+}
+
+// Takes the next message, once 'waiting' says there is one. It stays
+// valid until the next call.
+static Message* take(Mailbox* mailbox) {
+  Message* tail = mailbox->tail;
+  Message* next;
+  // A sender that swapped 'head' before the one that woke us may not
+  // have linked its message yet; it is a few instructions away.
+  while ((next = atomic_load_explicit(&tail->next,
+                                      memory_order_acquire)) == NULL) {
+    sched_yield();
+  }
+  mailbox->tail = next;
+  free(tail);
+  return next;
+}
+
+// --- The pool ---
+
+typedef struct Isolate {
+  Mailbox mailbox;
+  int id;
+  char* source; // Until the isolate has run
+  int length;
+  struct Isolate* nextJob;
+} Isolate;
+
+// Indexed by id. Slots are filled once and never cleared while the pool
+// runs, so senders can read them without a lock.
+static _Atomic(Isolate*) isolates[ISOLATES_MAX];
+static atomic_int isolateCount = 1;
+
+static pthread_once_t poolStarted = PTHREAD_ONCE_INIT;
+static int coreCount = 0;
+
+// Isolates waiting for a thread, and how many haven't finished yet. The
+// pool starts with a thread per core and grows when threads are stuck in
+// receive(), so that a queued isolate always gets to run.
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobsDone = PTHREAD_COND_INITIALIZER;
+static Isolate* firstJob = NULL;
+static Isolate* lastJob = NULL;
+static int unfinished = 0;
+static bool stopping = false;
+static pthread_t* threads = NULL;
+static int threadCount = 0;
+static int threadCapacity = 0;
+static int idleThreads = 0;    // Waiting for a job
+static int blockedThreads = 0; // Waiting in receive()
+
+static Isolate* newIsolate(int id) {
+  Isolate* isolate = malloc(sizeof(Isolate));
+  if (isolate == NULL) exit(1);
+  initMailbox(&isolate->mailbox);
+  isolate->id = id;
+  isolate->source = NULL;
+  isolate->length = 0;
+  isolate->nextJob = NULL;
+  return isolate;
+}
+
+static void* poolThread(void* arg) {
+  (void)arg;
+  // Too big to keep on a thread's stack, and reused for every isolate
+  VM* vm = malloc(sizeof(VM));
+  if (vm == NULL) exit(1);
+
+  for (;;) {
+    pthread_mutex_lock(&poolLock);
+    while (firstJob == NULL && !stopping) {
+      idleThreads++;
+      pthread_cond_wait(&jobQueued, &poolLock);
+      idleThreads--;
+    }
+    Isolate* isolate = firstJob;
+    if (isolate == NULL) {
+      pthread_mutex_unlock(&poolLock);
+      break;
+    }
+    firstJob = isolate->nextJob;
+    if (firstJob == NULL) lastJob = NULL;
+    pthread_mutex_unlock(&poolLock);
+
+    initVM(vm);
+    vm->isolate = isolate->id;
+    interpret(vm, isolate->source, isolate->length, 1);
+    freeVM(vm);
+    free(isolate->source);
+    isolate->source = NULL;
+
+    pthread_mutex_lock(&poolLock);
+    if (--unfinished == 0) pthread_cond_broadcast(&jobsDone);
+    pthread_mutex_unlock(&poolLock);
+  }
+
+  free(vm);
+  return NULL;
+}
+
+// Called with 'poolLock' held
+static void addThread() {
+  if (threadCount == threadCapacity) {
+    threadCapacity = threadCapacity < 8 ? 8 : threadCapacity * 2;
+    threads = realloc(threads, sizeof(pthread_t) * threadCapacity);
+    if (threads == NULL) exit(1);
+  }
+  if (pthread_create(&threads[threadCount], NULL, poolThread, NULL) != 0) {
+    exit(1);
+  }
+  threadCount++;
+}
+
+// Adds a thread if a job is queued, no thread is free to take it, and
+// fewer threads than cores are doing anything. Called with 'poolLock'
+// held whenever a job is queued or a thread starts waiting in receive().
+static void growPool() {
+  if (firstJob != NULL && idleThreads == 0 &&
+      threadCount - blockedThreads < coreCount) {
+    addThread();
+  }
+}
+
+static void startPool() {
+  atomic_store_explicit(&isolates[0], newIsolate(0), memory_order_release);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  coreCount = cores < 1 ? 1 : (int)cores;
+  pthread_mutex_lock(&poolLock);
+  for (int i = 0; i < coreCount; i++) addThread();
+  pthread_mutex_unlock(&poolLock);
+}
+
+int spawnIsolate(const char* source, int length) {
+  pthread_once(&poolStarted, startPool);
+
+  int id = atomic_fetch_add(&isolateCount, 1);
+  if (id >= ISOLATES_MAX) {
+    atomic_fetch_sub(&isolateCount, 1);
+    return -1;
+  }
+
+  Isolate* isolate = newIsolate(id);
+  isolate->source = malloc(length + 1);
+  if (isolate->source == NULL) exit(1);
+  memcpy(isolate->source, source, length);
+  isolate->source[length] = '\0';
+  isolate->length = length;
+  atomic_store_explicit(&isolates[id], isolate, memory_order_release);
+
+  pthread_mutex_lock(&poolLock);
+  if (lastJob == NULL) firstJob = isolate;
+  else lastJob->nextJob = isolate;
+  lastJob = isolate;
+  unfinished++;
+  pthread_cond_signal(&jobQueued);
+  growPool();
+  pthread_mutex_unlock(&poolLock);
+  return id;
+}
+
+static Isolate* findIsolate(int id) {
+  if (id < 0 || id >= ISOLATES_MAX) return NULL;
+  return atomic_load_explicit(&isolates[id], memory_order_acquire);
+}
+
+bool sendMessage(int id, Value value) {
+  Isolate* isolate = findIsolate(id);
+  if (isolate == NULL) return false;
+
+  Encoder encoder = {NULL, 0, 0};
+  if (!encodeValue(&encoder, value, 0)) {
+    free(encoder.bytes);
+    return false;
+  }
+  Message* message = newMessage(encoder.count);
+  memcpy(message->bytes, encoder.bytes, encoder.count);
+  free(encoder.bytes);
+
+  post(&isolate->mailbox, message);
+  return true;
+}
+
+// Blocks until 'isolate' has a message. A pool thread that has to wait
+// is counted as blocked, so the pool can start another one for the
+// isolates still queued; otherwise isolates waiting on each other could
+// hold every thread while the ones that would send to them never run.
+static void awaitMessage(Isolate* isolate) {
+  sem_t* waiting = &isolate->mailbox.waiting;
+  if (sem_trywait(waiting) == 0) return;
+
+  bool pooled = isolate->id != 0; // The main script has its own thread
+  if (pooled) {
+    pthread_mutex_lock(&poolLock);
+    blockedThreads++;
+    growPool();
+    pthread_mutex_unlock(&poolLock);
+  }
+  while (sem_wait(waiting) != 0) {} // Retry if interrupted
+  if (pooled) {
+    pthread_mutex_lock(&poolLock);
+    blockedThreads--;
+    pthread_mutex_unlock(&poolLock);
+  }
+}
+
+Value receiveMessage(VM* vm, int id) {
+  Isolate* isolate = findIsolate(id);
+  if (isolate == NULL) return NIL_VAL;
+
+  awaitMessage(isolate);
+  Message* message = take(&isolate->mailbox);
+  const uint8_t* cursor = message->bytes;
+  return decodeValue(vm, &cursor);
+}
+
+void joinIsolates() {
+  if (threads == NULL) return;
+
+  pthread_mutex_lock(&poolLock);
+  while (unfinished > 0) pthread_cond_wait(&jobsDone, &poolLock);
+  stopping = true;
+  pthread_cond_broadcast(&jobQueued);
+  pthread_mutex_unlock(&poolLock);
+
+  for (int i = 0; i < threadCount; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  threads = NULL;
+  threadCount = 0;
+  threadCapacity = 0;
+
+  int count = atomic_load(&isolateCount);
+  for (int id = 0; id < count && id < ISOLATES_MAX; id++) {
+    Isolate* isolate = atomic_load(&isolates[id]);
+    if (isolate == NULL) continue;
+    freeMailbox(&isolate->mailbox);
+    free(isolate);
+    atomic_store(&isolates[id], NULL);
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef asharp_isolate_h
+#define asharp_isolate_h
+
+#include "common.h"
+#include "value.h"
+
+// Isolates are scripts running in their own VM and heap on a pool of
+// threads, one per core plus one for each isolate stuck in receive().
+// They share no objects: a message is copied out of the sender's heap
+// and rebuilt in the receiver's. The first isolate is the main script,
+// with id 0.
+
+#define ISOLATES_MAX 256
+
+// Starts running 'source' on the pool. Returns the new isolate's id, or
+// -1 if ISOLATES_MAX have already been spawned.
+int spawnIsolate(const char* source, int length);
+
+// Copies 'value' into the mailbox of isolate 'id'. False if there is no
+// such isolate or the value can't be sent.
+bool sendMessage(int id, Value value);
+
+// Waits for the next message to isolate 'id' and rebuilds it in 'vm'.
+// Returns nil at once if nothing has been spawned yet, since no message
+// could ever arrive.
+Value receiveMessage(VM* vm, int id);
+
+// Waits for every spawned isolate to finish, then stops the pool
+void joinIsolates();
+
+#endif
@@ -1,6 +1,11 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Standard GNU Readline headers
 #include <readline/readline.h>
@@ -11,39 +16,16 @@
 #include "debug.h"
 #include "vm.h"
 #include "compiler.h"
+#include "isolate.h"
+#include "snapshot.h"
 
-// FILE READING HELPER
-static char* readFile(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(74);
-  }
-
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
-
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
-  }
-
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
-  }
-  
-  buffer[bytesRead] = '\0';
-
-  fclose(file);
-  return buffer;
+static void exitOnError(InterpretResult result) {
+  if (result == INTERPRET_COMPILE_ERROR) exit(65);
+  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
 //FILE EXECUTION
-static void repl() {
+static void repl(VM* vm) {
   printf("============Welcome to A-Sharp v0.1============\n");
   printf("Press Ctrl+D to quit.\n");
 
@@ -56,10 +38,11 @@ static void repl() {
       add_history(line);
     }
 
-    ObjFunction* function = compile(line);
+    size_t length = strlen(line);
+    ObjFunction* function = compile(vm, line, length, 1);
     if (function != NULL) {
         //printf("Compiled to a function object!\n");
-        interpret(line); // triggering interpreter in the terminal
+        interpret(vm, line, length, 1); // triggering interpreter in the terminal
     }
 
     // readline allocates memory for every line, so we must free it
@@ -67,30 +50,147 @@ static void repl() {
   }
 }
 
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  
-  //Pass the source string directly. The VM handles compilation now.
-  InterpretResult result = interpret(source); 
-  
-  free(source); 
+#define STREAM_CHUNK (64 * 1024)
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+// Reads a script from a pipe or terminal a chunk at a time, running each
+// run of complete top-level declarations as soon as it has arrived.
+// Globals carry over between pieces just like in the REPL.
+static void runStream(VM* vm, int fd) {
+  char* buffer = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  int line = 1;
+
+  for (;;) {
+    if (capacity - count < STREAM_CHUNK) {
+      capacity = capacity * 2 + STREAM_CHUNK;
+      buffer = (char*)realloc(buffer, capacity);
+      if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read input.\n");
+        exit(74);
+      }
+    }
+
+    ssize_t bytesRead = read(fd, buffer + count, capacity - count);
+    if (bytesRead < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Could not read input.\n");
+      exit(74);
+    }
+    count += (size_t)bytesRead;
+
+    // At end of input whatever is left is compiled, errors and all
+    size_t ready = bytesRead == 0 ? count : completeDeclarations(buffer, count);
+    if (ready > 0) {
+      exitOnError(interpret(vm, buffer, ready, line));
+      for (size_t i = 0; i < ready; i++) {
+        if (buffer[i] == '\n') line++;
+      }
+      memmove(buffer, buffer + ready, count - ready);
+      count -= ready;
+    }
+
+    if (bytesRead == 0) break;
+  }
+
+  free(buffer);
 }
+
+// Maps the script read-only and compiles it in place; nothing the
+// compiler keeps points into the source, so it is unmapped right after.
+static void runFile(VM* vm, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
+
+  // Pipes and devices can't be mapped
+  if (!S_ISREG(info.st_mode)) {
+    runStream(vm, fd);
+    close(fd);
+    return;
+  }
+
+  size_t size = (size_t)info.st_size;
+  const char* source = "";
+  if (size > 0) {
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      fprintf(stderr, "Could not read file \"%s\".\n", path);
+      exit(74);
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    source = mapped;
+  }
+  close(fd);
+
+  InterpretResult result = interpret(vm, source, size, 1);
+
+  if (size > 0) munmap((void*)source, size);
+  exitOnError(result);
+}
+
+static void usage() {
+  fprintf(stderr,
+      "Usage: asharp [-O] [--lazy] [--image file.img] [--snapshot file.img] "
+      "[script.as | -]\n");
+  exit(64);
+}
+
 // MAIN ENTRY POINT
 int main(int argc, const char* argv[]) {
-  initVM();
+  const char* imagePath = NULL;    // Boot from this heap image
+  const char* snapshotPath = NULL; // Save the heap here after the script
+  const char* scriptPath = NULL;
+  VM vm;
 
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  // Hashes must be stable before the first string is made
+  const char* seed = getenv("ASHARP_HASH_SEED");
+  if (seed != NULL) setHashSeed(strtoull(seed, NULL, 0));
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-O") == 0) {
+      compilerOptions.inlineCalls = true;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      compilerOptions.lazyFunctions = true;
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      imagePath = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      snapshotPath = argv[++i];
+    } else if ((argv[i][0] != '-' || strcmp(argv[i], "-") == 0) &&
+               scriptPath == NULL) {
+      scriptPath = argv[i];
+    } else {
+      usage();
+    }
+  }
+
+  if (imagePath != NULL) {
+    if (!initVMFromSnapshot(&vm, imagePath)) exit(74);
   } else {
-    fprintf(stderr, "Usage: asharp [script.as]\n");
-    exit(64);
+    initVM(&vm);
+  }
+
+  if (scriptPath != NULL && strcmp(scriptPath, "-") == 0) {
+    runStream(&vm, STDIN_FILENO);
+  } else if (scriptPath != NULL) {
+    runFile(&vm, scriptPath);
+  } else if (snapshotPath == NULL) {
+    repl(&vm);
   }
 
-  freeVM();
+  // The program ends once every isolate it spawned has finished
+  joinIsolates();
+
+  if (snapshotPath != NULL && !writeSnapshot(&vm, snapshotPath)) exit(74);
+
+  freeVM(&vm);
   return 0;
-}
\ No newline at end of file
+}
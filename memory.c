@@ -3,7 +3,9 @@
 #include "vm.h"
 #include "object.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize){
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize){
+    vm->bytesAllocated += newSize - oldSize;
+
 //CASE 1: Delete the Memory (newSize is 0)
     if(newSize==0){
         free(pointer);
@@ -19,39 +21,90 @@ if(result == NULL) exit(1);
 return result;
 }
 
-static void freeObject(Obj* object) {
+static void freeObject(VM* vm, Obj* object) {
   //Cleaning funtion and string objects
   switch (object->type) {
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE(vm, ObjNative, object);
+      break;
+    case OBJ_FLOAT_ARRAY: {
+      ObjFloatArray* array = (ObjFloatArray*)object;
+      FREE_ARRAY(vm, double, array->values, array->count);
+      FREE(vm, ObjFloatArray, object);
+      break;
+    }
+    case OBJ_BOUND_METHOD:
+      FREE(vm, ObjBoundMethod, object);
+      break;
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      freeTable(vm, &klass->methods);
+      FREE(vm, ObjClass, object);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+      FREE(vm, ObjInstance, object);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(vm, &shape->slots);
+      freeTable(vm, &shape->transitions);
+      FREE(vm, ObjShape, object);
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*)object;
+      freeTable(vm, &map->table);
+      FREE(vm, ObjMap, object);
+      break;
+    }
+    case OBJ_LIST: {
+      ObjList* list = (ObjList*)object;
+      freeValueArray(vm, &list->items);
+      FREE(vm, ObjList, object);
+      break;
+    }
+    case OBJ_SLICE:
+      FREE(vm, ObjSlice, object);
       break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
       // Free the character array first
-      FREE_ARRAY(char, string->chars, string->length + 1);
+      FREE_ARRAY(vm, char, string->chars, string->length + 1);
       // Then free the struct itself
-      FREE(ObjString, object);
+      FREE(vm, ObjString, object);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      freeChunk(vm, &function->chunk);
+      FREE_ARRAY(vm, char, function->lazySource, function->lazyLength + 1);
+      FREE(vm, ObjFunction, object);
       break;
     case OBJ_CLOSURE:
-      FREE(ObjClosure, object);
+      FREE(vm, ObjClosure, object);
       break;
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*)object;
+      FREE_ARRAY(vm, CallFrame, fiber->frames, FRAMES_MAX);
+      FREE_ARRAY(vm, Value, fiber->stack, FIBER_STACK_MAX);
+      FREE(vm, ObjFiber, object);
+      break;
+    }
     case OBJ_UPVALUE:
       break;
     }
   }
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
+void freeObjects(VM* vm) {
+  Obj* object = vm->objects;
   while (object != NULL) {
     Obj* next = object->next;
-    freeObject(object);
+    freeObject(vm, object);
     object = next;
   }
 }
\ No newline at end of file
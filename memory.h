@@ -8,22 +8,22 @@
     ((capacity)<8?8:(capacity)*2)
 
 //Resize command
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type)*(oldCount),\
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+    (type*)reallocate(vm, pointer, sizeof(type)*(oldCount),\
         sizeof(type)*(newCount))
 
 //The Delete Command
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
-void freeObjects();
+void freeObjects(VM* vm);
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-//Function
-void* reallocate(void*pointer, size_t oldSize, size_t newSize);
+//Function. The size change is counted in vm->bytesAllocated.
+void* reallocate(VM* vm, void*pointer, size_t oldSize, size_t newSize);
 
 #endif
 
@@ -0,0 +1,423 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+// --- Parsing ---
+
+static const double exactPowersOfTen[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_MANTISSA (1ull << 53)
+#define MAX_EXACT_POWER 22
+
+double parseNumber(const char* start, int length) {
+  // Clinger's fast path: when the digits fit in a double's mantissa and
+  // the power of ten is exact, one IEEE division rounds correctly.
+  uint64_t mantissa = 0;
+  int fractionDigits = 0;
+  bool inFraction = false;
+  bool exact = true;
+  for (int i = 0; i < length; i++) {
+    char c = start[i];
+    if (c == '.') {
+      inFraction = true;
+      continue;
+    }
+    if (mantissa > (MAX_EXACT_MANTISSA - 9) / 10) {
+      exact = false;
+      break;
+    }
+    mantissa = mantissa * 10 + (uint64_t)(c - '0');
+    if (inFraction) fractionDigits++;
+  }
+
+  if (exact && fractionDigits <= MAX_EXACT_POWER) {
+    return (double)mantissa / exactPowersOfTen[fractionDigits];
+  }
+
+  // Too many significant digits: let the C library do the hard case
+  char small[64];
+  char* text = length < (int)sizeof(small) ? small : malloc(length + 1);
+  memcpy(text, start, length);
+  text[length] = '\0';
+  double value = strtod(text, NULL);
+  if (text != small) free(text);
+  return value;
+}
+
+bool parseInteger(const char* start, int length, int64_t* result) {
+  uint64_t value = 0;
+  for (int i = 0; i < length; i++) {
+    if (start[i] == '.') return false;
+    uint64_t digit = (uint64_t)(start[i] - '0');
+    if (value > ((uint64_t)INT64_MAX - digit) / 10) return false;
+    value = value * 10 + digit;
+  }
+  *result = (int64_t)value;
+  return true;
+}
+
+// --- Formatting ---
+// Grisu3 with an exact fallback: the output reads back as exactly the
+// same double and has the fewest digits that do.
+
+typedef struct {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+#define DIY_SIGNIFICAND_SIZE 64
+#define DOUBLE_SIGNIFICAND_SIZE 52
+#define DOUBLE_EXPONENT_BIAS (0x3FF + DOUBLE_SIGNIFICAND_SIZE)
+#define DOUBLE_HIDDEN_BIT (1ull << DOUBLE_SIGNIFICAND_SIZE)
+#define DOUBLE_SIGNIFICAND_MASK (DOUBLE_HIDDEN_BIT - 1)
+
+// 10^k for k = -348, -340, ..., 340 as normalized f * 2^e
+static const DiyFp cachedPowers[] = {
+  {0xfa8fd5a0081c0288ull, -1220}, {0xbaaee17fa23ebf76ull, -1193}, {0x8b16fb203055ac76ull, -1166},
+  {0xcf42894a5dce35eaull, -1140}, {0x9a6bb0aa55653b2dull, -1113}, {0xe61acf033d1a45dfull, -1087},
+  {0xab70fe17c79ac6caull, -1060}, {0xff77b1fcbebcdc4full, -1034}, {0xbe5691ef416bd60cull, -1007},
+  {0x8dd01fad907ffc3cull, -980}, {0xd3515c2831559a83ull, -954}, {0x9d71ac8fada6c9b5ull, -927},
+  {0xea9c227723ee8bcbull, -901}, {0xaecc49914078536dull, -874}, {0x823c12795db6ce57ull, -847},
+  {0xc21094364dfb5637ull, -821}, {0x9096ea6f3848984full, -794}, {0xd77485cb25823ac7ull, -768},
+  {0xa086cfcd97bf97f4ull, -741}, {0xef340a98172aace5ull, -715}, {0xb23867fb2a35b28eull, -688},
+  {0x84c8d4dfd2c63f3bull, -661}, {0xc5dd44271ad3cdbaull, -635}, {0x936b9fcebb25c996ull, -608},
+  {0xdbac6c247d62a584ull, -582}, {0xa3ab66580d5fdaf6ull, -555}, {0xf3e2f893dec3f126ull, -529},
+  {0xb5b5ada8aaff80b8ull, -502}, {0x87625f056c7c4a8bull, -475}, {0xc9bcff6034c13053ull, -449},
+  {0x964e858c91ba2655ull, -422}, {0xdff9772470297ebdull, -396}, {0xa6dfbd9fb8e5b88full, -369},
+  {0xf8a95fcf88747d94ull, -343}, {0xb94470938fa89bcfull, -316}, {0x8a08f0f8bf0f156bull, -289},
+  {0xcdb02555653131b6ull, -263}, {0x993fe2c6d07b7facull, -236}, {0xe45c10c42a2b3b06ull, -210},
+  {0xaa242499697392d3ull, -183}, {0xfd87b5f28300ca0eull, -157}, {0xbce5086492111aebull, -130},
+  {0x8cbccc096f5088ccull, -103}, {0xd1b71758e219652cull, -77}, {0x9c40000000000000ull, -50},
+  {0xe8d4a51000000000ull, -24}, {0xad78ebc5ac620000ull, 3}, {0x813f3978f8940984ull, 30},
+  {0xc097ce7bc90715b3ull, 56}, {0x8f7e32ce7bea5c70ull, 83}, {0xd5d238a4abe98068ull, 109},
+  {0x9f4f2726179a2245ull, 136}, {0xed63a231d4c4fb27ull, 162}, {0xb0de65388cc8ada8ull, 189},
+  {0x83c7088e1aab65dbull, 216}, {0xc45d1df942711d9aull, 242}, {0x924d692ca61be758ull, 269},
+  {0xda01ee641a708deaull, 295}, {0xa26da3999aef774aull, 322}, {0xf209787bb47d6b85ull, 348},
+  {0xb454e4a179dd1877ull, 375}, {0x865b86925b9bc5c2ull, 402}, {0xc83553c5c8965d3dull, 428},
+  {0x952ab45cfa97a0b3ull, 455}, {0xde469fbd99a05fe3ull, 481}, {0xa59bc234db398c25ull, 508},
+  {0xf6c69a72a3989f5cull, 534}, {0xb7dcbf5354e9beceull, 561}, {0x88fcf317f22241e2ull, 588},
+  {0xcc20ce9bd35c78a5ull, 614}, {0x98165af37b2153dfull, 641}, {0xe2a0b5dc971f303aull, 667},
+  {0xa8d9d1535ce3b396ull, 694}, {0xfb9b7cd9a4a7443cull, 720}, {0xbb764c4ca7a44410ull, 747},
+  {0x8bab8eefb6409c1aull, 774}, {0xd01fef10a657842cull, 800}, {0x9b10a4e5e9913129ull, 827},
+  {0xe7109bfba19c0c9dull, 853}, {0xac2820d9623bf429ull, 880}, {0x80444b5e7aa7cf85ull, 907},
+  {0xbf21e44003acdd2dull, 933}, {0x8e679c2f5e44ff8full, 960}, {0xd433179d9c8cb841ull, 986},
+  {0x9e19db92b4e31ba9ull, 1013}, {0xeb96bf6ebadf77d9ull, 1039}, {0xaf87023b9bf0ee6bull, 1066},
+};
+
+static const uint64_t powersOfTen[] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+  10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+  100000000000ull, 1000000000000ull, 10000000000000ull,
+  100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+  100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+static DiyFp diyFromDouble(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int biasedExponent = (int)((bits >> DOUBLE_SIGNIFICAND_SIZE) & 0x7FF);
+  uint64_t significand = bits & DOUBLE_SIGNIFICAND_MASK;
+  if (biasedExponent != 0) {
+    return (DiyFp){significand + DOUBLE_HIDDEN_BIT,
+                   biasedExponent - DOUBLE_EXPONENT_BIAS};
+  }
+  return (DiyFp){significand, 1 - DOUBLE_EXPONENT_BIAS};
+}
+
+static DiyFp normalize(DiyFp x) {
+  int shift = __builtin_clzll(x.f);
+  return (DiyFp){x.f << shift, x.e - shift};
+}
+
+// The upper 64 bits of the 128-bit product, rounded
+static DiyFp multiply(DiyFp x, DiyFp y) {
+  unsigned __int128 product = (unsigned __int128)x.f * y.f;
+  uint64_t high = (uint64_t)(product >> 64);
+  uint64_t low = (uint64_t)product;
+  high += low >> 63;
+  return (DiyFp){high, x.e + y.e + DIY_SIGNIFICAND_SIZE};
+}
+
+// The midpoints to the neighbouring doubles, sharing plus's exponent
+static void boundaries(DiyFp v, DiyFp* minus, DiyFp* plus) {
+  *plus = normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+  if (v.f == DOUBLE_HIDDEN_BIT) {
+    *minus = (DiyFp){(v.f << 2) - 1, v.e - 2};
+  } else {
+    *minus = (DiyFp){(v.f << 1) - 1, v.e - 1};
+  }
+  minus->f <<= minus->e - plus->e;
+  minus->e = plus->e;
+}
+
+// A cached power c with c * 2^e in [2^-60, 2^-32), and its decimal exponent
+static DiyFp cachedPower(int e, int* decimalExponent) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int k = (int)dk;
+  if (dk - k > 0.0) k++;
+
+  int index = (k >> 3) + 1;
+  *decimalExponent = -(-348 + index * 8);
+  return cachedPowers[index];
+}
+
+// Nudges the last digit down while that moves closer to the exact value,
+// then checks the result is certain given that w, high and 'rest' may
+// each be off by 'unit'. False means it can't be told with this
+// precision and the caller must fall back.
+static bool roundWeed(char* buffer, int length, uint64_t distance,
+                      uint64_t unsafe, uint64_t rest, uint64_t tenKappa,
+                      uint64_t unit) {
+  uint64_t small = distance - unit;
+  uint64_t big = distance + unit;
+  while (rest < small && unsafe - rest >= tenKappa &&
+         (rest + tenKappa < small ||
+          small - rest >= rest + tenKappa - small)) {
+    buffer[length - 1]--;
+    rest += tenKappa;
+  }
+  // Would the digit have moved again for a value further away?
+  if (rest < big && unsafe - rest >= tenKappa &&
+      (rest + tenKappa < big || big - rest > rest + tenKappa - big)) {
+    return false;
+  }
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+static int countDigits(uint32_t n) {
+  int digits = 1;
+  while (digits < 10 && n >= powersOfTen[digits]) digits++;
+  return digits;
+}
+
+// Emits the digits of 'high', widened by the possible error, until the
+// remainder fits inside the widened interval, so the digits stand for a
+// number between the boundaries. Returns the length, or -1 if rounding
+// can't be settled.
+static int generateDigits(DiyFp low, DiyFp w, DiyFp high, char* buffer,
+                          int* decimalExponent) {
+  uint64_t unit = 1;
+  uint64_t tooLow = low.f - unit;
+  uint64_t tooHigh = high.f + unit;
+  uint64_t unsafe = tooHigh - tooLow;
+  uint64_t distance = tooHigh - w.f;
+
+  DiyFp one = {1ull << -high.e, high.e};
+  uint32_t integral = (uint32_t)(tooHigh >> -one.e);
+  uint64_t fraction = tooHigh & (one.f - 1);
+  int kappa = countDigits(integral);
+  int length = 0;
+
+  while (kappa > 0) {
+    uint32_t divisor = (uint32_t)powersOfTen[kappa - 1];
+    buffer[length++] = (char)('0' + integral / divisor);
+    integral %= divisor;
+    kappa--;
+
+    uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+    if (rest < unsafe) {
+      *decimalExponent += kappa;
+      bool settled = roundWeed(buffer, length, distance, unsafe, rest,
+                               (uint64_t)divisor << -one.e, unit);
+      return settled ? length : -1;
+    }
+  }
+
+  for (;;) {
+    fraction *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    buffer[length++] = (char)('0' + (fraction >> -one.e));
+    fraction &= one.f - 1;
+    kappa--;
+
+    if (fraction < unsafe) {
+      *decimalExponent += kappa;
+      bool settled = roundWeed(buffer, length, distance * unit, unsafe,
+                               fraction, one.f, unit);
+      return settled ? length : -1;
+    }
+  }
+}
+
+// Shortest digits of a positive finite 'value': value = digits * 10^exponent.
+// Grisu3 (Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+// Accurately with Integers") scales the value and its rounding
+// boundaries by a cached power of ten so the digits come from 64-bit
+// integer arithmetic, and tracks the error that scaling adds. It gives
+// up on about 0.5% of values, where that error could change the answer;
+// those return -1.
+static int grisu3(double value, char* digits, int* exponent) {
+  DiyFp v = diyFromDouble(value);
+  DiyFp minus, plus;
+  boundaries(v, &minus, &plus);
+
+  DiyFp power = cachedPower(plus.e, exponent);
+  DiyFp w = multiply(normalize(v), power);
+  DiyFp high = multiply(plus, power);
+  DiyFp low = multiply(minus, power);
+  return generateDigits(low, w, high, digits, exponent);
+}
+
+// True if digits * 10^exponent reads back as 'value'
+static bool readsBackAs(double value, const char* digits, int length,
+                        int exponent) {
+  char text[40];
+  memcpy(text, digits, length);
+  snprintf(text + length, sizeof(text) - length, "e%d", exponent);
+  return strtod(text, NULL) == value;
+}
+
+// Adds 'step' (1 or -1) to the last digit, carrying or borrowing, and
+// returns the new length
+static int stepLastDigit(char* digits, int length, int* exponent, int step) {
+  int i = length - 1;
+  if (step > 0) {
+    while (i >= 0 && digits[i] == '9') digits[i--] = '0';
+    if (i < 0) {
+      // 99..9 + 1 = 1 followed by zeros
+      *exponent += length;
+      digits[0] = '1';
+      return 1;
+    }
+    digits[i]++;
+  } else {
+    while (i > 0 && digits[i] == '0') digits[i--] = '9';
+    digits[i]--;
+    if (digits[0] == '0') {
+      if (length == 1) return 0; // Nothing left to try
+      memmove(digits, digits + 1, length - 1);
+      return length - 1;
+    }
+  }
+  return length;
+}
+
+// The exact fallback for what Grisu3 rejects. For each digit count from
+// one up, the correctly rounded digits from printf are the closest
+// candidate; if they don't read back, only the candidate one step away
+// on the other side of 'value' still could.
+static int shortestDigits(double value, char* digits, int* exponent) {
+  for (int precision = 1; precision <= 17; precision++) {
+    char text[40];
+    snprintf(text, sizeof(text), "%.*e", precision - 1, value);
+    int length = 0;
+    for (char* c = text; *c != 'e'; c++) {
+      if (*c != '.') digits[length++] = *c;
+    }
+    *exponent = atoi(strchr(text, 'e') + 1) - (length - 1);
+    if (readsBackAs(value, digits, length, *exponent)) return length;
+
+    for (int step = -1; step <= 1; step += 2) {
+      char candidate[20];
+      int candidateExponent = *exponent;
+      memcpy(candidate, digits, length);
+      int candidateLength = stepLastDigit(candidate, length,
+                                          &candidateExponent, step);
+      if (candidateLength > 0 &&
+          readsBackAs(value, candidate, candidateLength, candidateExponent)) {
+        memcpy(digits, candidate, candidateLength);
+        *exponent = candidateExponent;
+        return candidateLength;
+      }
+    }
+  }
+  return 0; // Unreachable: 17 digits always read back
+}
+
+static int writeUnsigned(uint64_t n, char* buffer) {
+  char reversed[20];
+  int length = 0;
+  do {
+    reversed[length++] = (char)('0' + n % 10);
+    n /= 10;
+  } while (n != 0);
+  for (int i = 0; i < length; i++) buffer[i] = reversed[length - 1 - i];
+  return length;
+}
+
+int formatInt(int64_t value, char* buffer) {
+  int length = 0;
+  // Negating in unsigned arithmetic keeps INT64_MIN in range
+  uint64_t magnitude = (uint64_t)value;
+  if (value < 0) {
+    buffer[length++] = '-';
+    magnitude = 0 - magnitude;
+  }
+  length += writeUnsigned(magnitude, buffer + length);
+  buffer[length] = '\0';
+  return length;
+}
+
+int formatNumber(double value, char* buffer) {
+  char* out = buffer;
+  if (isnan(value)) {
+    memcpy(out, "nan", 4);
+    return 3;
+  }
+  if (signbit(value)) {
+    *out++ = '-';
+    value = -value;
+  }
+  if (isinf(value)) {
+    memcpy(out, "inf", 4);
+    return (int)(out - buffer) + 3;
+  }
+
+  // Integers that fit the mantissa exactly are by far the common case
+  if (value < (double)MAX_EXACT_MANTISSA && value == (double)(uint64_t)value) {
+    out += writeUnsigned((uint64_t)value, out);
+    *out = '\0';
+    return (int)(out - buffer);
+  }
+
+  char digits[20];
+  int exponent;
+  int length = grisu3(value, digits, &exponent);
+  if (length < 0) length = shortestDigits(value, digits, &exponent);
+  // Drop zeros the digit generation can leave at the end
+  while (length > 1 && digits[length - 1] == '0') {
+    length--;
+    exponent++;
+  }
+  // Exponent of the first digit, as in d.ddd x 10^point
+  int point = length + exponent - 1;
+
+  if (point < -4 || point >= length) {
+    *out++ = digits[0];
+    if (length > 1) {
+      *out++ = '.';
+      memcpy(out, digits + 1, length - 1);
+      out += length - 1;
+    }
+    *out++ = 'e';
+    *out++ = point < 0 ? '-' : '+';
+    int magnitude = point < 0 ? -point : point;
+    if (magnitude < 10) *out++ = '0';
+    out += writeUnsigned((uint64_t)magnitude, out);
+  } else if (point >= 0) {
+    memcpy(out, digits, point + 1);
+    out += point + 1;
+    if (length > point + 1) {
+      *out++ = '.';
+      memcpy(out, digits + point + 1, length - point - 1);
+      out += length - point - 1;
+    }
+  } else {
+    *out++ = '0';
+    *out++ = '.';
+    memset(out, '0', -point - 1);
+    out += -point - 1;
+    memcpy(out, digits, length);
+    out += length;
+  }
+
+  *out = '\0';
+  return (int)(out - buffer);
+}
@@ -0,0 +1,26 @@
+#ifndef asharp_number_h
+#define asharp_number_h
+
+#include "common.h"
+
+// Longest text formatNumber() produces, plus the terminator
+#define NUMBER_BUFFER_SIZE 32
+
+// Converts a number literal (digits, optionally '.' and more digits) to
+// the nearest double. 'start' need not be NUL-terminated.
+double parseNumber(const char* start, int length);
+
+// Converts a literal with no '.' to an integer. False if it has a
+// fraction or doesn't fit in 64 bits, in which case it's a double.
+bool parseInteger(const char* start, int length, int64_t* result);
+
+// Writes text that reads back as exactly 'value' into 'buffer' and
+// returns its length. It uses the fewest digits that do. Integers print
+// without a fraction and very large or small values in exponent form,
+// as "%g" would.
+int formatNumber(double value, char* buffer);
+
+// Writes an integer in decimal and returns its length
+int formatInt(int64_t value, char* buffer);
+
+#endif
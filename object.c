@@ -7,86 +7,211 @@
 #include "table.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
+
+// String hashing, wyhash style: read 8 bytes at a time and mix with a
+// 64x64->128 bit multiply. The seed is fixed by default so hashes (and
+// table layouts) are the same from run to run; setHashSeed() changes it.
+
+#define DEFAULT_HASH_SEED 0x5a17d2c9e3b1f04bull
+
+static const uint64_t hashSecret[4] = {
+  0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+  0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+// Set at startup, before any VM exists, and shared by all of them
+static uint64_t hashSeed = DEFAULT_HASH_SEED;
+
+void setHashSeed(uint64_t seed) {
+  hashSeed = seed;
+}
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+  unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
 
 static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  const uint8_t* p = (const uint8_t*)key;
+  size_t remaining = (size_t)length;
+  uint64_t seed = hashSeed ^ hashMix(hashSeed ^ hashSecret[0], hashSecret[1]);
+  uint64_t a, b;
+
+  if (remaining <= 16) {
+    if (remaining >= 4) {
+      // Two overlapping pairs of 4-byte reads cover 4..16 bytes
+      size_t middle = (remaining >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + remaining - 4) << 32) | read32(p + remaining - 4 - middle);
+    } else if (remaining > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) |
+          p[remaining - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (remaining > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+        seed1 = hashMix(read64(p + 16) ^ hashSecret[2], read64(p + 24) ^ seed1);
+        seed2 = hashMix(read64(p + 32) ^ hashSecret[3], read64(p + 40) ^ seed2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (remaining > 16) {
+      seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+    a = read64(p + remaining - 16);
+    b = read64(p + remaining - 8);
   }
-  return hash;
+
+  unsigned __int128 product = (unsigned __int128)(a ^ hashSecret[1]) * (b ^ seed);
+  uint64_t hash = hashMix((uint64_t)product ^ hashSecret[0] ^ (uint64_t)length,
+                          (uint64_t)(product >> 64) ^ hashSecret[1]);
+  uint32_t folded = (uint32_t)(hash ^ (hash >> 32));
+  return folded != 0 ? folded : 1; // 0 means "not hashed yet"
 }
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+  Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
   
   // --- CRITICAL INITIALIZATION ---
   object->type = type; 
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm->objects;
+  vm->objects = object;
   
   return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash) {
+  ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
   string -> hash = hash;
   return string;
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
 
   // 1. Check if we already have this string!
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = stringSetFind(&vm->strings, chars, length, hash);
   if (interned != NULL) return interned; // Found it! Return the existing one.
 
   // 2. Otherwise, allocate memory for the characters
-  char* heapChars = ALLOCATE(char, length + 1);
+  char* heapChars = ALLOCATE(vm, char, length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
 
   // 3. Create the new object
-  ObjString* string = allocateString(heapChars, length, hash);
+  ObjString* string = allocateString(vm, heapChars, length, hash);
   
   // 4. Add it to the registry so we find it next time
-  tableSet(&vm.strings, string, NIL_VAL);
+  stringSetAdd(vm, &vm->strings, string);
 
   return string;
 }
 
-ObjString* takeString(char* chars, int length) {
+ObjString* takeString(VM* vm, char* chars, int length) {
+  // Long results are left unhashed until they are compared or used as a key
+  if (length > STRING_INTERN_MAX) return allocateString(vm, chars, length, 0);
+
   uint32_t hash = hashString(chars, length);
 
   // Check if string is already interned
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = stringSetFind(&vm->strings, chars, length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    FREE_ARRAY(vm, char, chars, length + 1);
     return interned;
   }
 
-  return allocateString(chars, length, hash);
+  ObjString* string = allocateString(vm, chars, length, hash);
+  stringSetAdd(vm, &vm->strings, string);
+  return string;
+}
+
+uint32_t stringHash(ObjString* string) {
+  if (string->hash == 0) string->hash = hashString(string->chars, string->length);
+  return string->hash;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+// Returns the interned string equal to 'string', interning it if there
+// is none yet. Table keys must go through this, since tables compare
+// keys by pointer.
+ObjString* internString(VM* vm, ObjString* string) {
+  if (string->length <= STRING_INTERN_MAX) return string;
+
+  uint32_t hash = stringHash(string);
+  ObjString* interned = stringSetFind(&vm->strings, string->chars,
+                                        string->length, hash);
+  if (interned != NULL) return interned;
+
+  stringSetAdd(vm, &vm->strings, string);
+  return string;
+}
+
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+  ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
   closure->function = function;
   return closure;
 }
 
-ObjFunction* newFunction() {
-  ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM* vm) {
+  ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
+  function->lazySource = NULL;
+  function->lazyLength = 0;
+  function->lazyLine = 0;
   initChunk(&function->chunk);
   return function;
 }
 
+ObjFiber* newFiber(VM* vm, ObjClosure* closure) {
+  ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+  fiber->closure = closure;
+  fiber->state = FIBER_NEW;
+  fiber->frames = ALLOCATE(vm, CallFrame, FRAMES_MAX);
+  fiber->stack = ALLOCATE(vm, Value, FIBER_STACK_MAX);
+  fiber->fromLoop = false;
+  fiber->caller = NULL;
+  fiber->callerFrameCount = 0;
+  fiber->callerStackTop = NULL;
+
+  // Set up as if the closure had just been called, so the first resume
+  // only has to supply the argument
+  fiber->stack[0] = OBJ_VAL(closure);
+  fiber->stackTop = fiber->stack + 1;
+  CallFrame* frame = &fiber->frames[0];
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  frame->slots = fiber->stack;
+  fiber->frameCount = 1;
+  return fiber;
+}
+
 static void printFunction(ObjFunction* function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -95,22 +220,208 @@ static void printFunction(ObjFunction* function) {
   printf("<fn %s>", function->name->chars);
 }
 
-ObjNative* newNative(NativeFn function) {
-  ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjList* newList(VM* vm) {
+  ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+static ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  if (parent != NULL) {
+    tableAddAll(vm, &parent->slots, &shape->slots);
+    tableSet(vm, &shape->slots, name, INT_VAL(parent->fieldCount));
+    shape->fieldCount = parent->fieldCount + 1;
+  }
+  return shape;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_INT(slot);
+}
+
+ObjShape* shapeAddField(VM* vm, ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) return (ObjShape*)AS_OBJ(next);
+
+  ObjShape* child = newShape(vm, shape, name);
+  tableSet(vm, &shape->transitions, name, OBJ_VAL(child));
+  return child;
+}
+
+ObjClass* newClass(VM* vm, ObjString* name) {
+  ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+  klass->name = name;
+  initTable(&klass->methods);
+  klass->shape = newShape(vm, NULL, NULL);
+  klass->fieldHint = 0;
+  return klass;
+}
+
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+  Value* fields = ALLOCATE(vm, Value, klass->fieldHint);
+  ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = klass->shape;
+  instance->fieldCapacity = klass->fieldHint;
+  instance->fields = fields;
+  return instance;
+}
+
+void instanceStore(VM* vm, ObjInstance* instance, ObjShape* shape, int slot,
+                   Value value) {
+  if (shape->fieldCount > instance->fieldCapacity) {
+    int capacity = GROW_CAPACITY(instance->fieldCapacity);
+    if (capacity < shape->fieldCount) capacity = shape->fieldCount;
+    instance->fields = GROW_ARRAY(vm, Value, instance->fields,
+                                  instance->fieldCapacity, capacity);
+    instance->fieldCapacity = capacity;
+    if (shape->fieldCount > instance->klass->fieldHint) {
+      instance->klass->fieldHint = shape->fieldCount;
+    }
+  }
+  instance->shape = shape;
+  instance->fields[slot] = value;
+}
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+  ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+ObjMap* newMap(VM* vm) {
+  ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+  initTable(&map->table);
+  return map;
+}
+
+// A list or map inside itself, or nested deeper than this, prints as
+// "[...]" or "{...}"
+#define PRINT_MAX_DEPTH 64
+
+// Per thread, since VMs on different threads print at the same time
+static _Thread_local Obj* printing[PRINT_MAX_DEPTH];
+static _Thread_local int printDepth = 0;
+
+// Returns false, having printed 'elided', if 'object' can't be printed
+static bool beginPrint(Obj* object, const char* elided) {
+  bool cycle = false;
+  for (int i = 0; i < printDepth; i++) {
+    if (printing[i] == object) cycle = true;
+  }
+  if (cycle || printDepth >= PRINT_MAX_DEPTH) {
+    printf("%s", elided);
+    return false;
+  }
+  printing[printDepth++] = object;
+  return true;
+}
+
+static void printList(ObjList* list) {
+  if (!beginPrint((Obj*)list, "[...]")) return;
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) printf(", ");
+    printValue(list->items.values[i]);
+  }
+  printf("]");
+  printDepth--;
+}
+
+static void printMap(ObjMap* map) {
+  if (!beginPrint((Obj*)map, "{...}")) return;
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->table.capacity; i++) {
+    Entry* entry = &map->table.entries[i];
+    if (IS_NIL(entry->key)) continue;
+    if (!first) printf(", ");
+    first = false;
+    printValue(entry->key);
+    printf(": ");
+    printValue(entry->value);
+  }
+  printf("}");
+  printDepth--;
+}
+
+ObjSlice* newSlice(VM* vm, ObjString* parent, int start, int length) {
+  ObjSlice* slice = ALLOCATE_OBJ(vm, ObjSlice, OBJ_SLICE);
+  slice->parent = parent;
+  slice->start = start;
+  slice->length = length;
+  return slice;
+}
+
+// Elements start out as zero
+ObjFloatArray* newFloatArray(VM* vm, int count) {
+  double* values = ALLOCATE(vm, double, count);
+  memset(values, 0, sizeof(double) * count);
+  ObjFloatArray* array = ALLOCATE_OBJ(vm, ObjFloatArray, OBJ_FLOAT_ARRAY);
+  array->count = count;
+  array->values = values;
+  return array;
+}
+
+static void printFloatArray(ObjFloatArray* array) {
+  printf("Float64Array[");
+  for (int i = 0; i < array->count; i++) {
+    if (i > 0) printf(", ");
+    printValue(NUMBER_VAL(array->values[i]));
+  }
+  printf("]");
+}
+
+ObjNative* newNative(VM* vm, NativeFn function) {
+  ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function = function;
   return native;
 }
 
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
+    case OBJ_BOUND_METHOD:
+      printFunction(AS_BOUND_METHOD(value)->method->function);
+      break;
+    case OBJ_CLASS:
+      printf("%s", AS_CLASS(value)->name->chars);
+      break;
+    case OBJ_INSTANCE:
+      printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+      break;
+    case OBJ_SHAPE:
+      printf("<shape>");
+      break;
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
       break;
+    case OBJ_FIBER:
+      printf("<fiber>");
+      break;
+    case OBJ_FLOAT_ARRAY:
+      printFloatArray(AS_FLOAT_ARRAY(value));
+      break;
+    case OBJ_LIST:
+      printList(AS_LIST(value));
+      break;
+    case OBJ_MAP:
+      printMap(AS_MAP(value));
+      break;
     case OBJ_NATIVE: //Addes case for OBJ_NATIVE
       printf("<native fn>");
       break;
+    case OBJ_SLICE:
     case OBJ_STRING:
-      printf("%s", AS_STRING(value)->chars);
+      fwrite(STRING_CHARS(value), 1, STRING_LENGTH(value), stdout);
       break;
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
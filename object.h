@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "table.h"
 
 // 1. MACROS
 #define OBJ_TYPE(value)   (AS_OBJ(value)->type)
@@ -14,13 +15,22 @@
 typedef struct Obj Obj;
 typedef struct ObjFunction ObjFunction;
 typedef struct ObjUpvalue ObjUpvalue;
-typedef Value (*NativeFn)(int argCount, Value* args);
+typedef Value (*NativeFn)(VM* vm, int argCount, Value* args);
 
 // 3. ENUM
 typedef enum {
+  OBJ_BOUND_METHOD,
+  OBJ_CLASS,
   OBJ_CLOSURE,
+  OBJ_FIBER,
+  OBJ_FLOAT_ARRAY,
   OBJ_FUNCTION,
+  OBJ_INSTANCE,
+  OBJ_LIST,
+  OBJ_MAP,
   OBJ_NATIVE,
+  OBJ_SHAPE,
+  OBJ_SLICE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
@@ -38,16 +48,39 @@ struct ObjString {
   Obj obj;
   int length;
   char* chars;
-  uint32_t hash;
+  uint32_t hash; // 0 until computed; see stringHash()
 };
 
+// Strings up to this length are always interned, so comparing their
+// pointers is enough. Longer ones built at runtime (by concatenation, say)
+// are only hashed and interned once something needs that.
+#define STRING_INTERN_MAX 64
+
+// Part of a string, as made by substr() and split(), sharing the
+// characters instead of copying them. It behaves like a string but is only
+// copied into a real (interned) one where identity matters: as a map key.
+// The parent is always a string, never another slice.
+typedef struct {
+  Obj obj;
+  ObjString* parent;
+  int start;
+  int length;
+} ObjSlice;
+
 // FIX 2: Added 'struct ObjFunction' tag
 struct ObjFunction {
   Obj obj;
   int arity;
   int upvalueCount;
+  int maxSlots; // Deepest the stack gets in this function's frame
   Chunk chunk;
   ObjString* name;
+
+  // Source of a body that has not been compiled yet (lazy mode).
+  // NULL once the function has real bytecode.
+  char* lazySource;
+  int lazyLength;
+  int lazyLine;
 };
 
 // FIX 3: Added 'struct ObjNative' tag (Optional, but good for consistency)
@@ -56,13 +89,96 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction* function;
   ObjUpvalue** upvalues;
   int upvalueCount;
 } ObjClosure;
 
+typedef enum {
+  FIBER_NEW,       // Created, not resumed yet
+  FIBER_SUSPENDED, // Waiting in yield()
+  FIBER_RUNNING,   // Running, or waiting for a fiber it resumed
+  FIBER_WAITING,   // Parked on the event loop (see event.h)
+  FIBER_DONE,      // Its function has returned
+} FiberState;
+
+// A coroutine with its own value stack and call frames. The VM runs it
+// by pointing its frames and stack at these (see vm.h).
+typedef struct ObjFiber {
+  Obj obj;
+  ObjClosure* closure;
+  FiberState state;
+  struct CallFrame* frames; // FRAMES_MAX of them
+  int frameCount;
+  Value* stack;             // FIBER_STACK_MAX slots
+  Value* stackTop;
+
+  // Where to go back to on yield() or return: the fiber that resumed
+  // this one (NULL for the main script) and how its stack stood. A fiber
+  // the event loop resumed has no caller.
+  bool fromLoop;
+  struct ObjFiber* caller;
+  int callerFrameCount;
+  Value* callerStackTop;
+} ObjFiber;
+
+// A growable array of values, stored contiguously
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+// A hash map from strings and numbers to values
+typedef struct {
+  Obj obj;
+  Table table;
+} ObjMap;
+
+// A fixed-length array of unboxed doubles, for the bulk numeric natives
+typedef struct {
+  Obj obj;
+  int count;
+  double* values;
+} ObjFloatArray;
+
+// A hidden class: the ordered set of fields an instance has. Instances
+// that gained the same fields in the same order share a shape, so a
+// field's slot can be cached per shape instead of looked up by name.
+// Every class has its own root shape, so a shape also implies a class.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape* parent;
+  ObjString* name;   // Field added on top of the parent (NULL for the root)
+  int fieldCount;
+  Table slots;       // Field name -> slot index
+  Table transitions; // Field name -> shape with that field added
+} ObjShape;
+
+typedef struct {
+  Obj obj;
+  ObjString* name;
+  Table methods;
+  ObjShape* shape;   // Root shape of new instances
+  int fieldHint;     // Most fields an instance has had, to size new ones
+} ObjClass;
+
+// Fields live in a flat array, in the order the shape gives them slots
+typedef struct {
+  Obj obj;
+  ObjClass* klass;
+  ObjShape* shape;
+  int fieldCapacity;
+  Value* fields;
+} ObjInstance;
+
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjClosure* method;
+} ObjBoundMethod;
+
 struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -76,23 +192,76 @@ static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
-ObjString* copyString(const char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
 void printObject(Value value);
 
-ObjString* takeString(char* chars, int length);
+ObjString* takeString(VM* vm, char* chars, int length);
+uint32_t stringHash(ObjString* string);
+ObjString* internString(VM* vm, ObjString* string);
+void setHashSeed(uint64_t seed);
 
-ObjFunction* newFunction();
+ObjFunction* newFunction(VM* vm);
 #define AS_FUNCTION(value)   ((ObjFunction*)AS_OBJ(value))
 #define IS_FUNCTION(value)   isObjType(value, OBJ_FUNCTION)
 
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(VM* vm, NativeFn function);
 #define AS_NATIVE(value)     (((ObjNative*)AS_OBJ(value))->function)
 #define IS_NATIVE(value)     isObjType(value, OBJ_NATIVE)
 
-ObjClosure* newClosure(ObjFunction* function);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
 #define AS_CLOSURE(value)    ((ObjClosure*)AS_OBJ(value))
 #define IS_CLOSURE(value)    isObjType(value, OBJ_CLOSURE)
 
+// A fiber about to call 'closure', which takes at most one argument
+ObjFiber* newFiber(VM* vm, ObjClosure* closure);
+#define AS_FIBER(value)      ((ObjFiber*)AS_OBJ(value))
+#define IS_FIBER(value)      isObjType(value, OBJ_FIBER)
+
+ObjList* newList(VM* vm);
+#define AS_LIST(value)       ((ObjList*)AS_OBJ(value))
+#define IS_LIST(value)       isObjType(value, OBJ_LIST)
+
+ObjClass* newClass(VM* vm, ObjString* name);
+#define AS_CLASS(value)      ((ObjClass*)AS_OBJ(value))
+#define IS_CLASS(value)      isObjType(value, OBJ_CLASS)
+
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+#define AS_INSTANCE(value)   ((ObjInstance*)AS_OBJ(value))
+#define IS_INSTANCE(value)   isObjType(value, OBJ_INSTANCE)
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+
+// Slot of 'name' in 'shape', or -1 if instances of the shape lack it
+int shapeSlot(ObjShape* shape, ObjString* name);
+// The shape reached by adding 'name' to 'shape', created on first use
+ObjShape* shapeAddField(VM* vm, ObjShape* shape, ObjString* name);
+// Stores 'value' in field 'slot' and moves the instance to 'shape',
+// growing its field array when the shape has more fields
+void instanceStore(VM* vm, ObjInstance* instance, ObjShape* shape, int slot,
+                   Value value);
+
+ObjMap* newMap(VM* vm);
+#define AS_MAP(value)        ((ObjMap*)AS_OBJ(value))
+#define IS_MAP(value)        isObjType(value, OBJ_MAP)
+
+ObjSlice* newSlice(VM* vm, ObjString* parent, int start, int length);
+#define AS_SLICE(value)      ((ObjSlice*)AS_OBJ(value))
+#define IS_SLICE(value)      isObjType(value, OBJ_SLICE)
+
+// Strings and slices alike. A slice's characters aren't NUL-terminated.
+#define IS_STRING_LIKE(value) (IS_STRING(value) || IS_SLICE(value))
+#define STRING_CHARS(value) \
+    (IS_SLICE(value) ? AS_SLICE(value)->parent->chars + AS_SLICE(value)->start \
+                     : AS_CSTRING(value))
+#define STRING_LENGTH(value) \
+    (IS_SLICE(value) ? AS_SLICE(value)->length : AS_STRING(value)->length)
+
+ObjFloatArray* newFloatArray(VM* vm, int count);
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray*)AS_OBJ(value))
+#define IS_FLOAT_ARRAY(value) isObjType(value, OBJ_FLOAT_ARRAY)
+
 ObjUpvalue* newUpvalue(Value* slot);
 
 #endif
\ No newline at end of file
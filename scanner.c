@@ -4,74 +4,234 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct{
-    const char* start;
-    const char* current;
-    int line;
-}Scanner;
+#ifdef __SSE2__
+#include <immintrin.h>
+#define SCANNER_SIMD
+#endif
+
+// Character runs the scanner can skip in bulk
+typedef enum {
+    CLASS_BLANK,       // ' ', '\t', '\r', '\n'
+    CLASS_IDENTIFIER,  // letters and '_'
+    CLASS_DIGIT,
+    CLASS_STRING_BODY, // anything but '"'
+} CharClass;
+
+// Per-byte flags, so classifying a character is one load and a mask
+enum {
+    CHAR_ALPHA = 1, // letters and '_'
+    CHAR_DIGIT = 2,
+    CHAR_BLANK = 4,
+};
+
+static const uint8_t charFlags[256] = {
+    ['a' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+    ['0' ... '9'] = CHAR_DIGIT,
+    [' '] = CHAR_BLANK, ['\t'] = CHAR_BLANK,
+    ['\r'] = CHAR_BLANK, ['\n'] = CHAR_BLANK,
+};
+
+static bool inClass(char c, CharClass cls){
+    uint8_t flags = charFlags[(uint8_t)c];
+    switch (cls){
+        case CLASS_BLANK:       return flags & CHAR_BLANK;
+        case CLASS_IDENTIFIER:  return flags & CHAR_ALPHA;
+        case CLASS_DIGIT:       return flags & CHAR_DIGIT;
+        case CLASS_STRING_BODY: return c != '"';
+    }
+    return false;
+}
+
+#ifdef SCANNER_SIMD
+// Block kernels: bit i of the result is set when p[i] is in 'cls', and
+// bit i of *newlines when p[i] is '\n'. The SSE2 one looks at 16 bytes,
+// the AVX2 one at 32; initScanner() picks the widest the CPU supports.
+
+static uint32_t blockMaskSse2(const char* p, CharClass cls, uint32_t* newlines){
+    __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+    __m128i newline = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'));
+    __m128i hit;
+    switch (cls){
+        case CLASS_BLANK:
+            hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                             _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))),
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')),
+                             newline));
+            break;
+        case CLASS_IDENTIFIER: {
+            // (c | 0x20) - 'a' < 26 as an unsigned byte, done as a signed
+            // compare after flipping the top bit.
+            __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+            __m128i offset = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 128));
+            hit = _mm_or_si128(
+                _mm_cmplt_epi8(offset, _mm_set1_epi8(-128 + 26)),
+                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')));
+            break;
+        }
+        case CLASS_DIGIT: {
+            __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8('0' - 128));
+            hit = _mm_cmplt_epi8(offset, _mm_set1_epi8(-128 + 10));
+            break;
+        }
+        default: // CLASS_STRING_BODY
+            hit = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'));
+            *newlines = (uint32_t)_mm_movemask_epi8(newline);
+            return ~(uint32_t)_mm_movemask_epi8(hit) & 0xffff;
+    }
+    *newlines = (uint32_t)_mm_movemask_epi8(newline);
+    return (uint32_t)_mm_movemask_epi8(hit);
+}
+
+__attribute__((target("avx2")))
+static uint32_t blockMaskAvx2(const char* p, CharClass cls, uint32_t* newlines){
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)p);
+    __m256i newline = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'));
+    __m256i hit;
+    switch (cls){
+        case CLASS_BLANK:
+            hit = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                                _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r')),
+                                newline));
+            break;
+        case CLASS_IDENTIFIER: {
+            __m256i lower = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+            __m256i offset = _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 128));
+            hit = _mm256_or_si256(
+                _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), offset),
+                _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_')));
+            break;
+        }
+        case CLASS_DIGIT: {
+            __m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8('0' - 128));
+            hit = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 10), offset);
+            break;
+        }
+        default: // CLASS_STRING_BODY
+            hit = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"'));
+            *newlines = (uint32_t)_mm256_movemask_epi8(newline);
+            return ~(uint32_t)_mm256_movemask_epi8(hit);
+    }
+    *newlines = (uint32_t)_mm256_movemask_epi8(newline);
+    return (uint32_t)_mm256_movemask_epi8(hit);
+}
+
+static int blockSize = 0;
+static uint32_t (*blockMask)(const char* p, CharClass cls, uint32_t* newlines);
+
+// Runs once at startup, before any thread can be scanning
+__attribute__((constructor))
+static void chooseKernel(){
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        blockSize = 32;
+        blockMask = blockMaskAvx2;
+    } else {
+        blockSize = 16;
+        blockMask = blockMaskSse2;
+    }
+}
+#endif
+
+// Skips the run of 'cls' characters starting at p and returns where it
+// ends, counting the newlines it crosses into scanner->line.
+static const char* skipRun(Scanner* scanner, const char* p, CharClass cls){
+#ifdef SCANNER_SIMD
+    while (scanner->end - p >= blockSize){
+        uint32_t newlines;
+        uint32_t hit = blockMask(p, cls, &newlines);
+        uint32_t miss = ~hit;
+        if (blockSize < 32) miss &= (1u << blockSize) - 1;
+        if (miss != 0){
+            int index = __builtin_ctz(miss);
+            scanner->line += __builtin_popcount(newlines & ((1u << index) - 1));
+            return p + index;
+        }
+        scanner->line += __builtin_popcount(newlines);
+        p += blockSize;
+    }
+#endif
+    while (p < scanner->end && inClass(*p, cls)){
+        if (*p == '\n') scanner->line++;
+        p++;
+    }
+    return p;
+}
 
-Scanner scanner;
+// The source need not be NUL-terminated (it may be a mapped file), so
+// nothing below reads at or past scanner->end.
+void initScanner(Scanner* scanner, const char* source, size_t length, int line){
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + length;
+    scanner->line = line;
+}
 
-void initScanner(const char* source){
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line =1;
+void rewindScanner(Scanner* scanner, const char* position, int line){
+    scanner->start = position;
+    scanner->current = position;
+    scanner->line = line;
 }
 
-static bool isAtEnd(){
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner){
+    return scanner->current >= scanner->end;
 }
 
-static char advance(){
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner){
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek (){
-    return *scanner.current;
+static char peek(Scanner* scanner){
+    if(isAtEnd(scanner)) return '\0';
+    return *scanner->current;
 }
 
-static char peekNext(){
-    if(isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner* scanner){
+    if(scanner->end - scanner->current < 2) return '\0';
+    return scanner->current[1];
 }
 
-static Token makeToken(TokenType type){
+static Token makeToken(Scanner* scanner, TokenType type){
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
 // Create an error token to tell the compiler something went wrong
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
 //skip the whitespaces and comments
-static void skipWhitespace(){
+static void skipWhitespace(Scanner* scanner){
     for(;;){
-        char c= peek();
+        char c= peek(scanner);
         switch (c){
             case ' ':
             case '\r':
             case '\t':
-                advance();
-                break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->current = skipRun(scanner, scanner->current, CLASS_BLANK);
                 break;
             case '/':
-                if(peekNext() == '/'){
-                    while(peek()!='\n'&& !isAtEnd()) advance();
+                if(peekNext(scanner) == '/'){
+                    // memchr is already vectorized by the C library
+                    const char* newline = memchr(scanner->current, '\n',
+                        scanner->end - scanner->current);
+                    scanner->current = newline != NULL ? newline : scanner->end;
                 } else{
                     return;
                 }
@@ -83,139 +243,143 @@ static void skipWhitespace(){
     }
 }
 
-static Token number(){
-    while(peek() >= '0' && peek()<='9') advance();
+static Token number(Scanner* scanner){
+    scanner->current = skipRun(scanner, scanner->current, CLASS_DIGIT);
 
-    if (peek() == '.' && (peekNext() >= '0' && peekNext() <= '9')){
-        advance();
-        while(peek() >= '0' && peek() <= '9') advance();
+    if (peek(scanner) == '.' && (peekNext(scanner) >= '0' && peekNext(scanner) <= '9')){
+        advance(scanner);
+        scanner->current = skipRun(scanner, scanner->current, CLASS_DIGIT);
     }
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static bool match(char expected) {
-  if (isAtEnd()) return false;
-  if (*scanner.current != expected) return false;
-  scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+  if (isAtEnd(scanner)) return false;
+  if (*scanner->current != expected) return false;
+  scanner->current++;
   return true;
 }
 
 //The Main Scan Function
 
-static TokenType checkKeyword(int start, int length,
-    const char* rest, TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
-
-  return TOKEN_IDENTIFIER;
-}
-
-static TokenType identifierType() {
-  switch (scanner.start[0]) {
-    case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    
-    // ... make sure 'f' (false, for, fun) are here ...
-    case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-      break;
-    
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-
-    //ADD THIS CASE FOR 'p'
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-      break;
-    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+// Keywords are found with a perfect hash on the first and last character.
+// To add one, add a line here; the assert below fails the build if it
+// collides, in which case pick new multipliers.
+#define KEYWORDS(X) \
+    X('a', 'd', "and",    TOKEN_AND)    \
+    X('c', 's', "class",  TOKEN_CLASS)  \
+    X('c', 't', "const",  TOKEN_CONST)  \
+    X('e', 'e', "else",   TOKEN_ELSE)   \
+    X('f', 'e', "false",  TOKEN_FALSE)  \
+    X('f', 'r', "for",    TOKEN_FOR)    \
+    X('f', 'n', "fun",    TOKEN_FUN)    \
+    X('i', 'f', "if",     TOKEN_IF)     \
+    X('n', 'l', "nil",    TOKEN_NIL)    \
+    X('o', 'r', "or",     TOKEN_OR)     \
+    X('p', 't', "print",  TOKEN_PRINT)  \
+    X('r', 'n', "return", TOKEN_RETURN) \
+    X('s', 'r', "super",  TOKEN_SUPER)  \
+    X('t', 's', "this",   TOKEN_THIS)   \
+    X('t', 'e', "true",   TOKEN_TRUE)   \
+    X('v', 'r', "var",    TOKEN_VAR)    \
+    X('w', 'e', "while",  TOKEN_WHILE)
+
+#define KEYWORD_SLOTS 64
+#define KEYWORD_HASH(first, last) \
+    ((5 * (unsigned)(first) + 2 * (unsigned)(last)) & (KEYWORD_SLOTS - 1))
+#define KEYWORD_MAX_LENGTH 6
+
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+#define KEYWORD_ENTRY(first, last, name, type) \
+    [KEYWORD_HASH(first, last)] = {name, sizeof(name) - 1, type},
+static const Keyword keywords[KEYWORD_SLOTS] = { KEYWORDS(KEYWORD_ENTRY) };
+
+// Distinct slots set distinct bits, so OR and sum agree only without collisions
+#define KEYWORD_BIT_OR(first, last, name, type) | (1ull << KEYWORD_HASH(first, last))
+#define KEYWORD_BIT_SUM(first, last, name, type) + (1ull << KEYWORD_HASH(first, last))
+_Static_assert((0 KEYWORDS(KEYWORD_BIT_OR)) == (0 KEYWORDS(KEYWORD_BIT_SUM)),
+               "keyword hash collision");
+
+static TokenType identifierType(Scanner* scanner) {
+  int length = (int)(scanner->current - scanner->start);
+  if (length < 2 || length > KEYWORD_MAX_LENGTH) return TOKEN_IDENTIFIER;
+
+  const Keyword* keyword = &keywords[KEYWORD_HASH((uint8_t)scanner->start[0],
+      (uint8_t)scanner->start[length - 1])];
+  if (keyword->length == length &&
+      memcmp(scanner->start, keyword->name, length) == 0) {
+    return keyword->type;
   }
-
   return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-  while ((peek() >= 'a' && peek() <= 'z') || 
-         (peek() >= 'A' && peek() <= 'Z') || 
-          peek() == '_') {
-    advance();
-  }
-  return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+  scanner->current = skipRun(scanner, scanner->current, CLASS_IDENTIFIER);
+  return makeToken(scanner, identifierType(scanner));
 }
 
-static Token string(){
-    while (peek() != '"' && !isAtEnd()){
-        if (peek()=='\n') scanner.line++;
-        advance();
-    }
+static Token string(Scanner* scanner){
+    scanner->current = skipRun(scanner, scanner->current, CLASS_STRING_BODY);
 
-    if (isAtEnd()) return errorToken("Unterminated String.");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated String.");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken(){
-    skipWhitespace();
-    scanner.start = scanner.current;
-
-    if(isAtEnd()) return makeToken(TOKEN_EOF);
-
-    char c = advance();
-
-    //check for letters
-    if((c>='a'&&c<='z') || (c>='A'&&c<='Z')||c=='_'){
-        return identifier();
-    }
-
-    //Check for Numbers;
-    if(c>= '0' && c<='9') return number();
-
-
-
-    switch(c){
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
-
-        case '"': return string();
-
-        // Two-character operators
-        case '!':
-        return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-        case '=':
-        return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<':
-        return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-        case '>':
-        return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+static const TokenType singleTokens[256] = {
+    [0 ... 255] = TOKEN_ERROR,
+    ['('] = TOKEN_LEFT_PAREN, [')'] = TOKEN_RIGHT_PAREN,
+    ['{'] = TOKEN_LEFT_BRACE, ['}'] = TOKEN_RIGHT_BRACE,
+    ['['] = TOKEN_LEFT_BRACKET, [']'] = TOKEN_RIGHT_BRACKET,
+    [';'] = TOKEN_SEMICOLON,  [','] = TOKEN_COMMA,
+    [':'] = TOKEN_COLON,
+    ['.'] = TOKEN_DOT,        ['-'] = TOKEN_MINUS,
+    ['+'] = TOKEN_PLUS,       ['/'] = TOKEN_SLASH,
+    ['*'] = TOKEN_STAR,       ['%'] = TOKEN_PERCENT,
+    ['&'] = TOKEN_AMPERSAND,  ['|'] = TOKEN_PIPE,
+    ['^'] = TOKEN_CARET,      ['~'] = TOKEN_TILDE,
+    ['!'] = TOKEN_BANG,       ['='] = TOKEN_EQUAL,
+    ['<'] = TOKEN_LESS,       ['>'] = TOKEN_GREATER,
+};
+
+static const TokenType equalTokens[256] = {
+    [0 ... 255] = TOKEN_ERROR,
+    ['!'] = TOKEN_BANG_EQUAL,    ['='] = TOKEN_EQUAL_EQUAL,
+    ['<'] = TOKEN_LESS_EQUAL,    ['>'] = TOKEN_GREATER_EQUAL,
+};
+
+static const TokenType doubledTokens[256] = {
+    [0 ... 255] = TOKEN_ERROR,
+    ['<'] = TOKEN_LESS_LESS,     ['>'] = TOKEN_GREATER_GREATER,
+};
+
+Token scanToken(Scanner* scanner){
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+
+    if(isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
+
+    uint8_t c = (uint8_t)advance(scanner);
+
+    uint8_t flags = charFlags[c];
+    if (flags & CHAR_ALPHA) return identifier(scanner);
+    if (flags & CHAR_DIGIT) return number(scanner);
+    if (c == '"') return string(scanner);
+
+    // Operators: the token alone, the token twice, and the token when
+    // followed by '='
+    TokenType type = singleTokens[c];
+    if (type == TOKEN_ERROR) return errorToken(scanner, "Unexpected Character.");
+    if (doubledTokens[c] != TOKEN_ERROR && match(scanner, (char)c)) {
+        type = doubledTokens[c];
+    } else if (equalTokens[c] != TOKEN_ERROR && match(scanner, '=')) {
+        type = equalTokens[c];
     }
-    return errorToken("Unexpected Character.");
+    return makeToken(scanner, type);
 }
\ No newline at end of file
@@ -1,24 +1,28 @@
 #ifndef asharp_scanner_h
 #define asharp_scanner_h
 
+#include "common.h"
+
 typedef enum {
   // Single-character tokens
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
-  TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_PERCENT,
+  TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_CARET, TOKEN_TILDE,
 
   // One or two character tokens
   TOKEN_BANG, TOKEN_BANG_EQUAL,
   TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
-  TOKEN_GREATER, TOKEN_GREATER_EQUAL,
-  TOKEN_LESS, TOKEN_LESS_EQUAL,
+  TOKEN_GREATER, TOKEN_GREATER_EQUAL, TOKEN_GREATER_GREATER,
+  TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_LESS_LESS,
 
   // Literals
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 
   // Keywords
-  TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
+  TOKEN_AND, TOKEN_CLASS, TOKEN_CONST, TOKEN_ELSE, TOKEN_FALSE,
   TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
   TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
   TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
@@ -26,6 +30,13 @@ typedef enum {
   TOKEN_ERROR, TOKEN_EOF
 } TokenType;
 
+typedef struct{
+    const char* start;
+    const char* current;
+    const char* end; //one past the last character, so SIMD loads stay in bounds
+    int line;
+}Scanner;
+
 typedef struct{
     TokenType type;
     const char* start; //pointer to start of the word
@@ -33,7 +44,9 @@ typedef struct{
     int line;
 }Token;
 
-void initScanner(const char* source);
-Token scanToken();
+void initScanner(Scanner* scanner, const char* source, size_t length, int line);
+// Moves back to 'position' within the current source
+void rewindScanner(Scanner* scanner, const char* position, int line);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
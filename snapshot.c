@@ -0,0 +1,746 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "table.h"
+#include "vm.h"
+
+// Image layout (native byte order):
+//
+//   header     "ASIM", version, object count, global count, const count
+//   objects    one record per object, dependencies before dependents
+//   globals    (name reference, value) pairs
+//   constants  (name reference, folded flag, value if folded) for every
+//              global const, so later compilations still enforce them
+//
+// Objects never store pointers. Every reference is the index of an
+// earlier record, and the loader relocates indices back into addresses
+// as it rebuilds the heap, so an image can be mapped anywhere.
+
+#define SNAPSHOT_MAGIC "ASIM"
+#define SNAPSHOT_VERSION 11
+#define NO_REF UINT32_MAX
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t objectCount;
+  uint32_t globalCount;
+  uint32_t constCount;
+} SnapshotHeader;
+
+// --- Writing ---
+
+typedef struct {
+  Obj* object;
+  uint32_t index;
+} ObjRef;
+
+typedef struct {
+  FILE* file;
+  uint32_t objectCount;
+  int capacity;
+  int count;
+  ObjRef* refs; // Open-addressed map from object address to record index
+  bool ok;
+} Writer;
+
+static uint32_t hashPointer(Obj* object, int capacity) {
+  uint64_t bits = (uint64_t)(uintptr_t)object >> 3;
+  return (uint32_t)((bits * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+static ObjRef* findRef(ObjRef* refs, int capacity, Obj* object) {
+  uint32_t index = hashPointer(object, capacity);
+  for (;;) {
+    ObjRef* ref = &refs[index];
+    if (ref->object == NULL || ref->object == object) return ref;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void addRef(VM* vm, Writer* writer, Obj* object, uint32_t index) {
+  if (writer->count + 1 > writer->capacity / 2) {
+    int capacity = GROW_CAPACITY(writer->capacity);
+    ObjRef* refs = ALLOCATE(vm, ObjRef, capacity);
+    memset(refs, 0, sizeof(ObjRef) * capacity);
+    for (int i = 0; i < writer->capacity; i++) {
+      if (writer->refs[i].object == NULL) continue;
+      *findRef(refs, capacity, writer->refs[i].object) = writer->refs[i];
+    }
+    FREE_ARRAY(vm, ObjRef, writer->refs, writer->capacity);
+    writer->refs = refs;
+    writer->capacity = capacity;
+  }
+
+  ObjRef* ref = findRef(writer->refs, writer->capacity, object);
+  ref->object = object;
+  ref->index = index;
+  writer->count++;
+}
+
+static uint32_t refOf(Writer* writer, Obj* object) {
+  if (object == NULL) return NO_REF;
+  return findRef(writer->refs, writer->capacity, object)->index;
+}
+
+static void writeBytes(Writer* writer, const void* bytes, size_t size) {
+  if (size > 0 && fwrite(bytes, 1, size, writer->file) != size) {
+    writer->ok = false;
+  }
+}
+
+static void writeU8(Writer* writer, uint8_t value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeU32(Writer* writer, uint32_t value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeValue(Writer* writer, Value value) {
+  writeU8(writer, (uint8_t)value.type);
+  switch (value.type) {
+    case VAL_BOOL:   writeU8(writer, AS_BOOL(value)); break;
+    case VAL_NIL:    break;
+    case VAL_NUMBER: {
+      double number = AS_NUMBER(value);
+      writeBytes(writer, &number, sizeof(number));
+      break;
+    }
+    case VAL_INT: {
+      int64_t integer = AS_INT(value);
+      writeBytes(writer, &integer, sizeof(integer));
+      break;
+    }
+    case VAL_OBJ:    writeU32(writer, refOf(writer, AS_OBJ(value))); break;
+  }
+}
+
+static void writeObject(VM* vm, Writer* writer, Obj* object);
+
+static void writeChildren(VM* vm, Writer* writer, Value value) {
+  if (IS_OBJ(value)) writeObject(vm, writer, AS_OBJ(value));
+}
+
+// False if 'value' is an object with no record yet. After its children
+// are written, that can only be a container claimed further up the
+// current path, i.e. one that (indirectly) contains itself.
+static bool written(Writer* writer, Value value) {
+  return !IS_OBJ(value) || refOf(writer, AS_OBJ(value)) != NO_REF;
+}
+
+static void cycleError(Writer* writer, const char* what) {
+  fprintf(stderr, "Can't snapshot %s that contains itself.\n", what);
+  writer->ok = false;
+}
+
+// Emits 'object' after everything it references (post-order), so the
+// loader can always resolve a reference to an already-built object.
+static void writeObject(VM* vm, Writer* writer, Obj* object) {
+  if (object == NULL || !writer->ok) return;
+  if (writer->count > 0 &&
+      findRef(writer->refs, writer->capacity, object)->object != NULL) {
+    return;
+  }
+
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      bool interned = string->hash != 0 &&
+          stringSetFind(&vm->strings, string->chars, string->length,
+                        string->hash) == string;
+      writeU8(writer, OBJ_STRING);
+      writeU8(writer, interned);
+      writeU32(writer, (uint32_t)string->length);
+      writeBytes(writer, string->chars, string->length);
+      break;
+    }
+    case OBJ_SLICE: {
+      ObjSlice* slice = (ObjSlice*)object;
+      writeObject(vm, writer, (Obj*)slice->parent);
+      writeU8(writer, OBJ_SLICE);
+      writeU32(writer, refOf(writer, (Obj*)slice->parent));
+      writeU32(writer, (uint32_t)slice->start);
+      writeU32(writer, (uint32_t)slice->length);
+      break;
+    }
+    case OBJ_NATIVE: {
+      const char* name = nativeName(((ObjNative*)object)->function);
+      if (name == NULL) {
+        fprintf(stderr, "Can't snapshot an unregistered native function.\n");
+        writer->ok = false;
+        return;
+      }
+      writeU8(writer, OBJ_NATIVE);
+      writeU32(writer, (uint32_t)strlen(name));
+      writeBytes(writer, name, strlen(name));
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      Chunk* chunk = &function->chunk;
+      writeObject(vm, writer, (Obj*)function->name);
+      for (int i = 0; i < chunk->constants.count; i++) {
+        writeChildren(vm, writer, chunk->constants.values[i]);
+      }
+
+      writeU8(writer, OBJ_FUNCTION);
+      writeU32(writer, (uint32_t)function->arity);
+      writeU32(writer, (uint32_t)function->upvalueCount);
+      writeU32(writer, (uint32_t)function->maxSlots);
+      writeU32(writer, refOf(writer, (Obj*)function->name));
+      writeU32(writer, (uint32_t)function->lazyLine);
+      writeU32(writer, (uint32_t)function->lazyLength);
+      writeBytes(writer, function->lazySource, function->lazyLength);
+      writeU32(writer, (uint32_t)chunk->count);
+      writeBytes(writer, chunk->code, chunk->count);
+      for (int i = 0; i < chunk->count; i++) {
+        writeU32(writer, (uint32_t)chunk->lines[i]);
+      }
+      writeU32(writer, (uint32_t)chunk->constants.count);
+      for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(writer, chunk->constants.values[i]);
+      }
+      // Inline caches hold addresses, so only their number is kept
+      writeU32(writer, (uint32_t)chunk->cacheCount);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      Table* methods = &klass->methods;
+      writeObject(vm, writer, (Obj*)klass->name);
+      for (int i = 0; i < methods->capacity; i++) {
+        if (IS_NIL(methods->entries[i].key)) continue;
+        writeChildren(vm, writer, methods->entries[i].key);
+        writeChildren(vm, writer, methods->entries[i].value);
+      }
+      if (!writer->ok) return;
+
+      writeU8(writer, OBJ_CLASS);
+      writeU32(writer, refOf(writer, (Obj*)klass->name));
+      writeU32(writer, (uint32_t)methods->count);
+      for (int i = 0; i < methods->capacity; i++) {
+        if (IS_NIL(methods->entries[i].key)) continue;
+        writeU32(writer, refOf(writer, AS_OBJ(methods->entries[i].key)));
+        writeU32(writer, refOf(writer, AS_OBJ(methods->entries[i].value)));
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      int fieldCount = instance->shape->fieldCount;
+      // Claimed first, like a list. The loader rebuilds the shape by
+      // adding the fields back in slot order.
+      addRef(vm, writer, object, NO_REF);
+      writeObject(vm, writer, (Obj*)instance->klass);
+      for (ObjShape* shape = instance->shape; shape->parent != NULL;
+           shape = shape->parent) {
+        writeObject(vm, writer, (Obj*)shape->name);
+      }
+      for (int i = 0; i < fieldCount; i++) {
+        writeChildren(vm, writer, instance->fields[i]);
+      }
+      if (!writer->ok) return;
+      for (int i = 0; i < fieldCount; i++) {
+        if (!written(writer, instance->fields[i])) {
+          cycleError(writer, "an instance");
+          return;
+        }
+      }
+
+      ObjString** names = ALLOCATE(vm, ObjString*, fieldCount);
+      for (ObjShape* shape = instance->shape; shape->parent != NULL;
+           shape = shape->parent) {
+        names[shape->fieldCount - 1] = shape->name;
+      }
+      writeU8(writer, OBJ_INSTANCE);
+      writeU32(writer, refOf(writer, (Obj*)instance->klass));
+      writeU32(writer, (uint32_t)fieldCount);
+      for (int i = 0; i < fieldCount; i++) {
+        writeU32(writer, refOf(writer, (Obj*)names[i]));
+        writeValue(writer, instance->fields[i]);
+      }
+      FREE_ARRAY(vm, ObjString*, names, fieldCount);
+      findRef(writer->refs, writer->capacity, object)->index =
+          writer->objectCount++;
+      return;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      writeChildren(vm, writer, bound->receiver);
+      writeObject(vm, writer, (Obj*)bound->method);
+      if (!writer->ok) return;
+      if (!written(writer, bound->receiver)) {
+        cycleError(writer, "a method bound to an object");
+        return;
+      }
+
+      writeU8(writer, OBJ_BOUND_METHOD);
+      writeValue(writer, bound->receiver);
+      writeU32(writer, refOf(writer, (Obj*)bound->method));
+      break;
+    }
+    case OBJ_LIST: {
+      ObjList* list = (ObjList*)object;
+      // Claim the list before its items, so one that (indirectly)
+      // contains itself shows up below as a reference with no record.
+      addRef(vm, writer, object, NO_REF);
+      for (int i = 0; i < list->items.count; i++) {
+        writeChildren(vm, writer, list->items.values[i]);
+      }
+      if (!writer->ok) return;
+      for (int i = 0; i < list->items.count; i++) {
+        if (!written(writer, list->items.values[i])) {
+          cycleError(writer, "a list");
+          return;
+        }
+      }
+
+      writeU8(writer, OBJ_LIST);
+      writeU32(writer, (uint32_t)list->items.count);
+      for (int i = 0; i < list->items.count; i++) {
+        writeValue(writer, list->items.values[i]);
+      }
+      findRef(writer->refs, writer->capacity, object)->index =
+          writer->objectCount++;
+      return;
+    }
+    case OBJ_MAP: {
+      Table* table = &((ObjMap*)object)->table;
+      // Claimed first, like a list, to catch a map inside itself
+      addRef(vm, writer, object, NO_REF);
+      for (int i = 0; i < table->capacity; i++) {
+        if (IS_NIL(table->entries[i].key)) continue;
+        writeChildren(vm, writer, table->entries[i].key);
+        writeChildren(vm, writer, table->entries[i].value);
+      }
+      if (!writer->ok) return;
+      for (int i = 0; i < table->capacity; i++) {
+        if (IS_NIL(table->entries[i].key)) continue;
+        if (!written(writer, table->entries[i].value)) {
+          cycleError(writer, "a map");
+          return;
+        }
+      }
+
+      writeU8(writer, OBJ_MAP);
+      writeU32(writer, (uint32_t)table->count);
+      for (int i = 0; i < table->capacity; i++) {
+        if (IS_NIL(table->entries[i].key)) continue;
+        writeValue(writer, table->entries[i].key);
+        writeValue(writer, table->entries[i].value);
+      }
+      findRef(writer->refs, writer->capacity, object)->index =
+          writer->objectCount++;
+      return;
+    }
+    case OBJ_FLOAT_ARRAY: {
+      ObjFloatArray* array = (ObjFloatArray*)object;
+      writeU8(writer, OBJ_FLOAT_ARRAY);
+      writeU32(writer, (uint32_t)array->count);
+      writeBytes(writer, array->values, sizeof(double) * array->count);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      writeObject(vm, writer, (Obj*)closure->function);
+      writeU8(writer, OBJ_CLOSURE);
+      writeU32(writer, refOf(writer, (Obj*)closure->function));
+      break;
+    }
+    default:
+      fprintf(stderr, "Can't snapshot object of type %d.\n", object->type);
+      writer->ok = false;
+      return;
+  }
+
+  addRef(vm, writer, object, writer->objectCount++);
+}
+
+bool writeSnapshot(VM* vm, const char* path) {
+  Writer writer;
+  writer.file = fopen(path, "wb");
+  if (writer.file == NULL) {
+    fprintf(stderr, "Could not open snapshot \"%s\".\n", path);
+    return false;
+  }
+  writer.objectCount = 0;
+  writer.capacity = 0;
+  writer.count = 0;
+  writer.refs = NULL;
+  writer.ok = true;
+
+  SnapshotHeader header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+  header.version = SNAPSHOT_VERSION;
+  header.objectCount = 0;
+  header.globalCount = 0;
+  header.constCount = 0;
+  writeBytes(&writer, &header, sizeof(header));
+
+  // Interned strings first so the restored string table is complete even
+  // for strings no global refers to (e.g. names used only by code).
+  for (int i = 0; i < vm->strings.capacity; i++) {
+    ObjString* string = vm->strings.entries[i].string;
+    if (string != NULL) writeObject(vm, &writer, (Obj*)string);
+  }
+
+  for (int i = 0; i < vm->globals.capacity; i++) {
+    Entry* entry = &vm->globals.entries[i];
+    if (IS_NIL(entry->key)) continue;
+    writeObject(vm, &writer, AS_OBJ(entry->key));
+    writeChildren(vm, &writer, entry->value);
+  }
+  for (int i = 0; i < vm->constValues.capacity; i++) {
+    Entry* entry = &vm->constValues.entries[i];
+    if (!IS_NIL(entry->key)) writeChildren(vm, &writer, entry->value);
+  }
+
+  for (int i = 0; i < vm->globals.capacity && writer.ok; i++) {
+    Entry* entry = &vm->globals.entries[i];
+    if (IS_NIL(entry->key)) continue;
+    writeU32(&writer, refOf(&writer, AS_OBJ(entry->key)));
+    writeValue(&writer, entry->value);
+    header.globalCount++;
+  }
+
+  for (int i = 0; i < vm->constNames.capacity && writer.ok; i++) {
+    Entry* entry = &vm->constNames.entries[i];
+    if (IS_NIL(entry->key)) continue;
+    Value value;
+    bool folded = tableGet(&vm->constValues, AS_STRING(entry->key), &value);
+    writeU32(&writer, refOf(&writer, AS_OBJ(entry->key)));
+    writeU8(&writer, folded ? 1 : 0);
+    if (folded) writeValue(&writer, value);
+    header.constCount++;
+  }
+
+  header.objectCount = writer.objectCount;
+  if (writer.ok && fseek(writer.file, 0L, SEEK_SET) == 0) {
+    writeBytes(&writer, &header, sizeof(header));
+  } else {
+    writer.ok = false;
+  }
+
+  if (fclose(writer.file) != 0) writer.ok = false;
+  FREE_ARRAY(vm, ObjRef, writer.refs, writer.capacity);
+
+  if (!writer.ok) {
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", path);
+    remove(path);
+  }
+  return writer.ok;
+}
+
+// --- Loading ---
+
+typedef struct {
+  const uint8_t* current;
+  const uint8_t* end;
+  Obj** objects; // Relocation table: record index -> rebuilt object
+  uint32_t objectCount;
+  bool ok;
+} Reader;
+
+static const uint8_t* readBytes(Reader* reader, size_t size) {
+  if (!reader->ok || (size_t)(reader->end - reader->current) < size) {
+    reader->ok = false;
+    return NULL;
+  }
+  const uint8_t* bytes = reader->current;
+  reader->current += size;
+  return bytes;
+}
+
+static uint8_t readU8(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 1);
+  return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readU32(Reader* reader) {
+  uint32_t value = 0;
+  const uint8_t* bytes = readBytes(reader, sizeof(value));
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static Obj* readRef(Reader* reader, ObjType type, bool nullable) {
+  uint32_t index = readU32(reader);
+  if (nullable && index == NO_REF) return NULL;
+  if (index >= reader->objectCount || reader->objects[index] == NULL ||
+      reader->objects[index]->type != type) {
+    reader->ok = false;
+    return NULL;
+  }
+  return reader->objects[index];
+}
+
+static Value readValue(Reader* reader) {
+  switch (readU8(reader)) {
+    case VAL_BOOL: return BOOL_VAL(readU8(reader) != 0);
+    case VAL_NIL:  return NIL_VAL;
+    case VAL_NUMBER: {
+      double number = 0;
+      const uint8_t* bytes = readBytes(reader, sizeof(number));
+      if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case VAL_INT: {
+      int64_t integer = 0;
+      const uint8_t* bytes = readBytes(reader, sizeof(integer));
+      if (bytes != NULL) memcpy(&integer, bytes, sizeof(integer));
+      return INT_VAL(integer);
+    }
+    case VAL_OBJ: {
+      uint32_t index = readU32(reader);
+      if (index >= reader->objectCount || reader->objects[index] == NULL) {
+        reader->ok = false;
+        return NIL_VAL;
+      }
+      return OBJ_VAL(reader->objects[index]);
+    }
+    default:
+      reader->ok = false;
+      return NIL_VAL;
+  }
+}
+
+static Obj* readObject(VM* vm, Reader* reader) {
+  switch (readU8(reader)) {
+    case OBJ_STRING: {
+      bool interned = readU8(reader) != 0;
+      uint32_t length = readU32(reader);
+      const char* chars = (const char*)readBytes(reader, length);
+      if (chars == NULL) return NULL;
+      if (interned) return (Obj*)copyString(vm, chars, (int)length);
+
+      char* heapChars = ALLOCATE(vm, char, length + 1);
+      memcpy(heapChars, chars, length);
+      heapChars[length] = '\0';
+      return (Obj*)takeString(vm, heapChars, (int)length);
+    }
+    case OBJ_SLICE: {
+      ObjString* parent = (ObjString*)readRef(reader, OBJ_STRING, false);
+      uint32_t start = readU32(reader);
+      uint32_t length = readU32(reader);
+      if (parent == NULL || start > (uint32_t)parent->length ||
+          length > (uint32_t)parent->length - start) {
+        reader->ok = false;
+        return NULL;
+      }
+      return (Obj*)newSlice(vm, parent, (int)start, (int)length);
+    }
+    case OBJ_NATIVE: {
+      uint32_t length = readU32(reader);
+      const char* name = (const char*)readBytes(reader, length);
+      if (name == NULL) return NULL;
+      NativeFn function = findNative(name, (int)length);
+      if (function == NULL) {
+        fprintf(stderr, "Snapshot refers to unknown native '%.*s'.\n",
+                (int)length, name);
+        reader->ok = false;
+        return NULL;
+      }
+      return (Obj*)newNative(vm, function);
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = newFunction(vm);
+      function->arity = (int)readU32(reader);
+      function->upvalueCount = (int)readU32(reader);
+      function->maxSlots = (int)readU32(reader);
+      function->name = (ObjString*)readRef(reader, OBJ_STRING, true);
+
+      // A body that was still lazy when the image was taken stays lazy.
+      function->lazyLine = (int)readU32(reader);
+      uint32_t lazyLength = readU32(reader);
+      const char* lazySource = (const char*)readBytes(reader, lazyLength);
+      if (lazySource == NULL) return NULL;
+      if (lazyLength > 0) {
+        function->lazyLength = (int)lazyLength;
+        function->lazySource = ALLOCATE(vm, char, lazyLength + 1);
+        memcpy(function->lazySource, lazySource, lazyLength);
+        function->lazySource[lazyLength] = '\0';
+      }
+
+      Chunk* chunk = &function->chunk;
+      uint32_t count = readU32(reader);
+      const uint8_t* code = readBytes(reader, count);
+      const uint8_t* lines = readBytes(reader, (size_t)count * sizeof(uint32_t));
+      if (code == NULL || lines == NULL) return NULL;
+      if (count > 0) {
+        chunk->code = ALLOCATE(vm, uint8_t, count);
+        chunk->lines = ALLOCATE(vm, int, count);
+        memcpy(chunk->code, code, count);
+        memcpy(chunk->lines, lines, (size_t)count * sizeof(int));
+      }
+      chunk->count = chunk->capacity = (int)count;
+
+      uint32_t constantCount = readU32(reader);
+      for (uint32_t i = 0; i < constantCount && reader->ok; i++) {
+        writeValueArray(vm, &chunk->constants, readValue(reader));
+      }
+
+      uint32_t cacheCount = readU32(reader);
+      if (reader->ok && cacheCount > 0) {
+        chunk->caches = ALLOCATE(vm, InlineCache, cacheCount);
+        memset(chunk->caches, 0, sizeof(InlineCache) * cacheCount);
+        chunk->cacheCount = (int)cacheCount;
+      }
+      return (Obj*)function;
+    }
+    case OBJ_CLASS: {
+      ObjString* name = (ObjString*)readRef(reader, OBJ_STRING, false);
+      if (name == NULL) return NULL;
+      ObjClass* klass = newClass(vm, name);
+      uint32_t count = readU32(reader);
+      for (uint32_t i = 0; i < count && reader->ok; i++) {
+        Obj* methodName = readRef(reader, OBJ_STRING, false);
+        Obj* method = readRef(reader, OBJ_CLOSURE, false);
+        if (method == NULL) break;
+        tableSet(vm, &klass->methods, (ObjString*)methodName, OBJ_VAL(method));
+      }
+      return (Obj*)klass;
+    }
+    case OBJ_INSTANCE: {
+      ObjClass* klass = (ObjClass*)readRef(reader, OBJ_CLASS, false);
+      if (klass == NULL) return NULL;
+      ObjInstance* instance = newInstance(vm, klass);
+      uint32_t count = readU32(reader);
+      for (uint32_t i = 0; i < count && reader->ok; i++) {
+        ObjString* name = (ObjString*)readRef(reader, OBJ_STRING, false);
+        Value value = readValue(reader);
+        if (name == NULL) break;
+        ObjShape* shape = instance->shape;
+        instanceStore(vm, instance, shapeAddField(vm, shape, name), shape->fieldCount,
+                      value);
+      }
+      return (Obj*)instance;
+    }
+    case OBJ_BOUND_METHOD: {
+      Value receiver = readValue(reader);
+      Obj* method = readRef(reader, OBJ_CLOSURE, false);
+      if (method == NULL) return NULL;
+      return (Obj*)newBoundMethod(vm, receiver, (ObjClosure*)method);
+    }
+    case OBJ_LIST: {
+      ObjList* list = newList(vm);
+      uint32_t count = readU32(reader);
+      for (uint32_t i = 0; i < count && reader->ok; i++) {
+        writeValueArray(vm, &list->items, readValue(reader));
+      }
+      return (Obj*)list;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = newMap(vm);
+      uint32_t count = readU32(reader);
+      for (uint32_t i = 0; i < count && reader->ok; i++) {
+        Value key = readValue(reader);
+        Value value = readValue(reader);
+        if (IS_STRING(key)) {
+          key = OBJ_VAL(internString(vm, AS_STRING(key)));
+        } else if (!IS_NUMERIC(key)) {
+          reader->ok = false;
+          break;
+        }
+        tableSetValue(vm, &map->table, key, value);
+      }
+      return (Obj*)map;
+    }
+    case OBJ_FLOAT_ARRAY: {
+      uint32_t count = readU32(reader);
+      const uint8_t* values = readBytes(reader, (size_t)count * sizeof(double));
+      if (values == NULL) return NULL;
+      ObjFloatArray* array = newFloatArray(vm, (int)count);
+      memcpy(array->values, values, (size_t)count * sizeof(double));
+      return (Obj*)array;
+    }
+    case OBJ_CLOSURE: {
+      Obj* function = readRef(reader, OBJ_FUNCTION, false);
+      if (function == NULL) return NULL;
+      return (Obj*)newClosure(vm, (ObjFunction*)function);
+    }
+    default:
+      reader->ok = false;
+      return NULL;
+  }
+}
+
+bool loadSnapshot(VM* vm, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+    fprintf(stderr, "Snapshot \"%s\" is truncated.\n", path);
+    close(fd);
+    return false;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "Could not map snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  SnapshotHeader header;
+  memcpy(&header, image, sizeof(header));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, 4) != 0 ||
+      header.version != SNAPSHOT_VERSION) {
+    fprintf(stderr, "\"%s\" is not an A-Sharp snapshot.\n", path);
+    munmap(image, size);
+    return false;
+  }
+
+  Reader reader;
+  reader.current = (const uint8_t*)image + sizeof(header);
+  reader.end = (const uint8_t*)image + size;
+  reader.objectCount = 0;
+  reader.ok = header.objectCount <= size; // Every record is at least a byte
+  reader.objects = reader.ok ? ALLOCATE(vm, Obj*, header.objectCount) : NULL;
+
+  for (uint32_t i = 0; i < header.objectCount && reader.ok; i++) {
+    reader.objects[i] = readObject(vm, &reader);
+    if (reader.objects[i] == NULL) reader.ok = false;
+    reader.objectCount++;
+  }
+
+  for (uint32_t i = 0; i < header.globalCount && reader.ok; i++) {
+    ObjString* name = (ObjString*)readRef(&reader, OBJ_STRING, false);
+    Value value = readValue(&reader);
+    if (reader.ok) tableSet(vm, &vm->globals, name, value);
+  }
+
+  for (uint32_t i = 0; i < header.constCount && reader.ok; i++) {
+    ObjString* name = (ObjString*)readRef(&reader, OBJ_STRING, false);
+    bool folded = readU8(&reader) != 0;
+    Value value = folded ? readValue(&reader) : NIL_VAL;
+    if (!reader.ok) break;
+    tableSet(vm, &vm->constNames, name, NIL_VAL);
+    if (folded) tableSet(vm, &vm->constValues, name, value);
+  }
+
+  if (reader.ok && reader.current != reader.end) reader.ok = false;
+
+  if (reader.objects != NULL) {
+    FREE_ARRAY(vm, Obj*, reader.objects, header.objectCount);
+  }
+  munmap(image, size);
+
+  if (!reader.ok) {
+    fprintf(stderr, "Snapshot \"%s\" is corrupt.\n", path);
+  }
+  return reader.ok;
+}
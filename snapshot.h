@@ -0,0 +1,14 @@
+#ifndef asharp_snapshot_h
+#define asharp_snapshot_h
+
+#include "common.h"
+
+// Writes every object reachable from the globals and the string table
+// into a relocatable heap image at 'path'.
+bool writeSnapshot(VM* vm, const char* path);
+
+// Maps a heap image into memory and rebuilds the objects, globals and
+// interned strings it describes. The VM must be freshly initialized.
+bool loadSnapshot(VM* vm, const char* path);
+
+#endif
@@ -6,62 +6,284 @@
 #include "table.h"
 #include "value.h"
 
+#if defined(TABLE_SWISS) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef TABLE_SWISS
+#define TABLE_MAX_LOAD 0.875
+#define TABLE_MIN_CAPACITY 16 // One group
+#else
 #define TABLE_MAX_LOAD 0.75
+#define TABLE_MIN_CAPACITY 8
+#endif
+
+// Deleting below this load halves the table
+#define TABLE_MIN_LOAD 0.25
+
+// The finalizer spreads the bits, which matters because whole doubles
+// differ only in their top bits and small integers only in their bottom ones.
+static uint32_t hashBits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Numbers hash by their bits, with -0 folded into 0 since the two are
+// equal keys
+static uint32_t hashNumber(double number) {
+  number += 0.0;
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  return hashBits(bits);
+}
+
+// String keys are interned, so their hash is already known
+static inline uint32_t hashKey(Value key) {
+  if (IS_INT(key)) return hashBits((uint64_t)AS_INT(key));
+  if (IS_NUMBER(key)) return hashNumber(AS_NUMBER(key));
+  return AS_STRING(key)->hash;
+}
+
+static inline bool keysEqual(Value a, Value b) {
+  if (a.type != b.type) return false;
+  if (IS_NUMBER(a)) return AS_NUMBER(a) == AS_NUMBER(b);
+  if (IS_INT(a)) return AS_INT(a) == AS_INT(b);
+  return AS_OBJ(a) == AS_OBJ(b);
+}
 
 void initTable(Table* table) {
   table->count = 0;
   table->capacity = 0;
   table->entries = NULL;
+#ifdef TABLE_SWISS
+  table->control = NULL;
+  table->tombstones = 0;
+#endif
 }
 
-void freeTable(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+  FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+#ifdef TABLE_SWISS
+  FREE_ARRAY(vm, uint8_t, table->control, table->capacity);
+#endif
   initTable(table);
 }
 
+static void adjustCapacity(VM* vm, Table* table, int capacity);
+
+static void shrinkIfSparse(VM* vm, Table* table) {
+  if (table->capacity > TABLE_MIN_CAPACITY &&
+      table->count < table->capacity * TABLE_MIN_LOAD) {
+    adjustCapacity(vm, table, table->capacity / 2);
+  }
+}
+
+#ifdef TABLE_SWISS
+// Swiss table: a separate control byte per slot holds 7 bits of the key's
+// hash, or marks the slot empty or deleted. A probe compares the control
+// bytes of a 16-slot group at once and only looks at entries whose hash
+// bits match, moving to the next group only when this one has no empty
+// slot. Free slots keep a nil key, so walking the entries still works.
+
+#define GROUP_SIZE 16
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xFE // Full slots have the top bit clear
+
+#define HASH_BITS(hash) ((uint8_t)((hash) >> 25))
+
+// Bit i is set when control byte i of the group equals 'byte'
+static uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) {
+    if (group[i] == byte) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Bit i is set when slot i of the group is empty or deleted
+static uint32_t matchFree(const uint8_t* group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i*)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) {
+    if (group[i] & 0x80) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Groups are visited at triangular offsets, which reaches every group
+// of a power-of-two table.
+#define PROBE_START(hash, capacity) \
+  ((int)((hash) & (uint32_t)((capacity) - 1)) & ~(GROUP_SIZE - 1))
+#define PROBE_NEXT(index, step, capacity) \
+  (((index) + ((step) += GROUP_SIZE)) & ((capacity) - 1))
+
+// Returns the slot holding 'key', or else the first free slot on its path
+static int findEntry(uint8_t* control, Entry* entries, int capacity,
+                     Value key) {
+  uint32_t hash = hashKey(key);
+  uint8_t bits = HASH_BITS(hash);
+  int index = PROBE_START(hash, capacity);
+  int step = 0;
+  int freeSlot = -1;
+
+  for (;;) {
+    const uint8_t* group = &control[index];
+    for (uint32_t hits = matchByte(group, bits); hits != 0; hits &= hits - 1) {
+      int slot = index + __builtin_ctz(hits);
+      if (keysEqual(entries[slot].key, key)) return slot;
+    }
+
+    uint32_t free = matchFree(group);
+    if (freeSlot == -1 && free != 0) freeSlot = index + __builtin_ctz(free);
+    if (matchByte(group, CONTROL_EMPTY) != 0) return freeSlot;
+
+    index = PROBE_NEXT(index, step, capacity);
+  }
+}
+
+// Retrieve a value
+bool tableGetValue(Table* table, Value key, Value* value) {
+  if (table->count == 0) return false;
+
+  Entry* entry = &table->entries[findEntry(table->control, table->entries,
+                                           table->capacity, key)];
+  if (IS_NIL(entry->key)) return false;
+
+  *value = entry->value;
+  return true;
+}
+
+// Resize the arrays when they get too full or too sparse
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+  Entry* entries = ALLOCATE(vm, Entry, capacity);
+  uint8_t* control = ALLOCATE(vm, uint8_t, capacity);
+  memset(control, CONTROL_EMPTY, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NIL_VAL;
+    entries[i].value = NIL_VAL;
+  }
+
+  // Re-hash existing items, dropping the deleted ones
+  table->count = 0;
+  table->tombstones = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (IS_NIL(entry->key)) continue;
+
+    int slot = findEntry(control, entries, capacity, entry->key);
+    control[slot] = HASH_BITS(hashKey(entry->key));
+    entries[slot] = *entry;
+    table->count++;
+  }
+
+  FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+  FREE_ARRAY(vm, uint8_t, table->control, table->capacity);
+  table->entries = entries;
+  table->control = control;
+  table->capacity = capacity;
+}
+
+// Insert or Update a value
+bool tableSetValue(VM* vm, Table* table, Value key, Value value) {
+  if (table->count + table->tombstones + 1 >
+      table->capacity * TABLE_MAX_LOAD) {
+    // Mostly deleted slots: rehashing at the same size clears them
+    int capacity = table->capacity;
+    if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2) {
+      capacity = GROW_CAPACITY(capacity);
+      if (capacity < TABLE_MIN_CAPACITY) capacity = TABLE_MIN_CAPACITY;
+    }
+    adjustCapacity(vm, table, capacity);
+  }
+
+  int slot = findEntry(table->control, table->entries, table->capacity, key);
+  Entry* entry = &table->entries[slot];
+  bool isNewKey = IS_NIL(entry->key);
+
+  if (isNewKey) {
+    table->count++;
+    if (table->control[slot] == CONTROL_DELETED) table->tombstones--;
+  }
+
+  table->control[slot] = HASH_BITS(hashKey(key));
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+// Delete a key
+bool tableDeleteValue(VM* vm, Table* table, Value key) {
+  if (table->count == 0) return false;
+
+  int slot = findEntry(table->control, table->entries, table->capacity, key);
+  Entry* entry = &table->entries[slot];
+  if (IS_NIL(entry->key)) return false;
+
+  // A group with an empty slot has never been full since the last
+  // rehash, so no probe has passed through it and the slot can simply
+  // be emptied. Only slots in full groups need a deleted marker.
+  if (matchByte(&table->control[slot & ~(GROUP_SIZE - 1)],
+                CONTROL_EMPTY) != 0) {
+    table->control[slot] = CONTROL_EMPTY;
+  } else {
+    table->control[slot] = CONTROL_DELETED;
+    table->tombstones++;
+  }
+  entry->key = NIL_VAL;
+  entry->value = NIL_VAL;
+  table->count--;
+  shrinkIfSparse(vm, table);
+  return true;
+}
+
+#else
+
 // The core search function (Linear Probing)
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash & (capacity - 1); // Fast modulo
-  Entry* tombstone = NULL;
+static Entry* findEntry(Entry* entries, int capacity, Value key) {
+  uint32_t index = hashKey(key) & (capacity - 1); // Fast modulo
 
   for (;;) {
     Entry* entry = &entries[index];
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
-    }
+    // Empty entry, or we found the key. Deletion leaves no tombstones.
+    if (IS_NIL(entry->key) || keysEqual(entry->key, key)) return entry;
 
     index = (index + 1) & (capacity - 1); // Loop around
   }
 }
 
 // Retrieve a value
-bool tableGet(Table* table, ObjString* key, Value* value) {
+bool tableGetValue(Table* table, Value key, Value* value) {
   if (table->count == 0) return false;
 
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (IS_NIL(entry->key)) return false;
 
   *value = entry->value;
   return true;
 }
 
-// Resize the array when it gets too full
-static void adjustCapacity(Table* table, int capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);
+// Resize the array when it gets too full or too sparse
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+  Entry* entries = ALLOCATE(vm, Entry, capacity);
   
   // Initialize new array to empty
   for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
+    entries[i].key = NIL_VAL;
     entries[i].value = NIL_VAL;
   }
 
@@ -69,7 +291,7 @@ static void adjustCapacity(Table* table, int capacity) {
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue; // Skip empty/tombstone
+    if (IS_NIL(entry->key)) continue; // Skip empty
 
     Entry* dest = findEntry(entries, capacity, entry->key);
     dest->key = entry->key;
@@ -77,70 +299,175 @@ static void adjustCapacity(Table* table, int capacity) {
     table->count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(vm, Entry, table->entries, table->capacity);
   table->entries = entries;
   table->capacity = capacity;
 }
 
 // Insert or Update a value
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSetValue(VM* vm, Table* table, Value key, Value value) {
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+    adjustCapacity(vm, table, capacity);
   }
 
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  
-  // Only increment count if we aren't overwriting a tombstone
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
+  bool isNewKey = IS_NIL(entry->key);
+  if (isNewKey) table->count++;
 
   entry->key = key;
   entry->value = value;
   return isNewKey;
 }
 
-// Delete a key (Mark as Tombstone)
-bool tableDelete(Table* table, ObjString* key) {
+// Delete a key (Backward shift)
+bool tableDeleteValue(VM* vm, Table* table, Value key) {
   if (table->count == 0) return false;
 
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (IS_NIL(entry->key)) return false;
 
-  // Place a tombstone (NULL key, TRUE value)
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true); 
+  // Pull later entries of the same run back into the hole whenever the
+  // hole lies between their home slot and where they sit, so every
+  // probe still reaches its key without crossing an empty slot.
+  int mask = table->capacity - 1;
+  int hole = (int)(entry - table->entries);
+  int index = hole;
+  for (;;) {
+    index = (index + 1) & mask;
+    Entry* next = &table->entries[index];
+    if (IS_NIL(next->key)) break;
+
+    int home = (int)(hashKey(next->key) & mask);
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      table->entries[hole] = *next;
+      hole = index;
+    }
+  }
+
+  table->entries[hole].key = NIL_VAL;
+  table->entries[hole].value = NIL_VAL;
+  table->count--;
+  shrinkIfSparse(vm, table);
   return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+#endif
+
+bool tableGet(Table* table, ObjString* key, Value* value) {
+  return tableGetValue(table, OBJ_VAL(key), value);
+}
+
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+  return tableSetValue(vm, table, OBJ_VAL(key), value);
+}
+
+bool tableDelete(VM* vm, Table* table, ObjString* key) {
+  return tableDeleteValue(vm, table, OBJ_VAL(key));
+}
+
+void tableAddAll(VM* vm, Table* from, Table* to) {
   for (int i = 0; i < from->capacity; i++) {
     Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+    if (!IS_NIL(entry->key)) {
+      tableSetValue(vm, to, entry->key, entry->value);
+    }
+  }
+}
+
+// --- String Intern Set ---
+// Linear probing over 16-byte entries. A probe compares the inline hash
+// and length first and only reads the characters when both match.
+
+#define STRING_SET_MAX_LOAD 0.75
+
+void initStringSet(StringSet* set) {
+  set->count = 0;
+  set->capacity = 0;
+  set->entries = NULL;
+}
+
+void freeStringSet(VM* vm, StringSet* set) {
+  FREE_ARRAY(vm, InternEntry, set->entries, set->capacity);
+  initStringSet(set);
+}
+
+ObjString* stringSetFind(StringSet* set, const char* chars, int length,
+                         uint32_t hash) {
+  if (set->count == 0) return NULL;
+
+  uint32_t mask = (uint32_t)set->capacity - 1;
+  for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+    InternEntry* entry = &set->entries[index];
+    if (entry->string == NULL) return NULL;
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->string->chars, chars, length) == 0) {
+      return entry->string;
+    }
+  }
+}
+
+static void insertEntry(InternEntry* entries, int capacity, InternEntry entry) {
+  uint32_t mask = (uint32_t)capacity - 1;
+  uint32_t index = entry.hash & mask;
+  while (entries[index].string != NULL) index = (index + 1) & mask;
+  entries[index] = entry;
+}
+
+static void resizeStringSet(VM* vm, StringSet* set, int capacity) {
+  InternEntry* entries = ALLOCATE(vm, InternEntry, capacity);
+  memset(entries, 0, sizeof(InternEntry) * capacity);
+  for (int i = 0; i < set->capacity; i++) {
+    if (set->entries[i].string != NULL) {
+      insertEntry(entries, capacity, set->entries[i]);
     }
   }
+
+  FREE_ARRAY(vm, InternEntry, set->entries, set->capacity);
+  set->entries = entries;
+  set->capacity = capacity;
 }
 
-// Special function for String Interning
-// Checks if a string exists WITHOUT creating an ObjString first
-ObjString* tableFindString(Table* table, const char* chars, 
-                           int length, uint32_t hash) {
-  if (table->count == 0) return NULL;
+// 'string' must be hashed and not in the set yet
+void stringSetAdd(VM* vm, StringSet* set, ObjString* string) {
+  if (set->count + 1 > set->capacity * STRING_SET_MAX_LOAD) {
+    resizeStringSet(vm, set, GROW_CAPACITY(set->capacity));
+  }
+
+  insertEntry(set->entries, set->capacity,
+              (InternEntry){string->hash, string->length, string});
+  set->count++;
+}
 
-  uint32_t index = hash & (table->capacity - 1);
+// Backward-shift deletion, as for the linear Table layout
+bool stringSetRemove(VM* vm, StringSet* set, ObjString* string) {
+  if (set->count == 0) return false;
+
+  uint32_t mask = (uint32_t)set->capacity - 1;
+  uint32_t hole = string->hash & mask;
+  while (set->entries[hole].string != string) {
+    if (set->entries[hole].string == NULL) return false;
+    hole = (hole + 1) & mask;
+  }
+
+  uint32_t index = hole;
   for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone slot
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-               entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      // Found it!
-      return entry->key;
+    index = (index + 1) & mask;
+    InternEntry* next = &set->entries[index];
+    if (next->string == NULL) break;
+
+    uint32_t home = next->hash & mask;
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      set->entries[hole] = *next;
+      hole = index;
     }
+  }
 
-    index = (index + 1) & (table->capacity - 1);
+  set->entries[hole].string = NULL;
+  set->count--;
+  if (set->capacity > TABLE_MIN_CAPACITY &&
+      set->count < set->capacity * TABLE_MIN_LOAD) {
+    resizeStringSet(vm, set, set->capacity / 2);
   }
-}
\ No newline at end of file
+  return true;
+}
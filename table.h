@@ -4,9 +4,9 @@
 #include "common.h"
 #include "value.h"
 
-//A key-value pair
+//A key-value pair. Keys are strings or numbers; a nil key marks a free slot
 typedef struct{
-    ObjString* key;
+    Value key;
     Value value;
 }Entry;
 
@@ -15,16 +15,47 @@ typedef struct{
     int count;
     int capacity;
     Entry* entries;
+#ifdef TABLE_SWISS
+    uint8_t* control; // one byte per entry: empty, deleted or 7 hash bits
+    int tombstones;   // deleted slots, which count towards the load
+#endif
 }Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 
 //Core Operations
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
-bool tableDelete(Table* table, ObjString* key);
-void tabelAddAll(Table* from, Table* to);
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
+bool tableDelete(VM* vm, Table* table, ObjString* key);
+void tableAddAll(VM* vm, Table* from, Table* to);
+
+//The same, keyed by any string or number. String keys must be interned
+//(see internString) and number keys must not be NaN. An integer never
+//matches a double, so callers store whole numbers as integers.
+bool tableGetValue(Table* table, Value key, Value* value);
+bool tableSetValue(VM* vm, Table* table, Value key, Value value);
+bool tableDeleteValue(VM* vm, Table* table, Value key);
+
+//An interned string, with its hash and length kept inline so most
+//mismatches are rejected without touching the string itself
+typedef struct{
+    uint32_t hash;
+    int length;
+    ObjString* string;
+}InternEntry;
+
+//The String Intern Set
+typedef struct{
+    int count;
+    int capacity;
+    InternEntry* entries;
+}StringSet;
+
+void initStringSet(StringSet* set);
+void freeStringSet(VM* vm, StringSet* set);
+ObjString* stringSetFind(StringSet* set, const char* chars, int length, uint32_t hash);
+void stringSetAdd(VM* vm, StringSet* set, ObjString* string);
+bool stringSetRemove(VM* vm, StringSet* set, ObjString* string);
 
 #endif
\ No newline at end of file
@@ -51,4 +51,165 @@ fun fib(n) {
 var start = clock();
 print fib(10); // Should be 55
 print "Time taken:";
-print clock() - start;
\ No newline at end of file
+print clock() - start;
+
+
+print "=== Test 6: Constants ===";
+const SECONDS_PER_DAY = 60 * 60 * 24;
+print SECONDS_PER_DAY; // Should be 86400
+
+fun days(n) {
+  return n * SECONDS_PER_DAY;
+}
+print days(2); // Should be 172800
+
+
+print "=== Test 7: Lists ===";
+var primes = [2, 3, 5, 7];
+append(primes, 11);
+print primes; // Should be [2, 3, 5, 7, 11]
+print len(primes); // Should be 5
+
+primes[0] = 1;
+var total = 0;
+for (var i = 0; i < len(primes); i = i + 1) {
+  total = total + primes[i];
+}
+print total; // Should be 27
+
+print "=== Test 8: Float64Arrays ===";
+var samples = floatArray([1, 2, 3, 4]);
+samples[0] = 10;
+print samples; // Should be Float64Array[10, 2, 3, 4]
+print sum(samples); // Should be 19
+print dot(samples, samples); // Should be 129
+print prefixSum(samples); // Should be Float64Array[10, 12, 15, 19]
+var gappy = floatArray([1, 2, 3, 4, 0 / 0, 6, 7, 8]);
+print min(gappy); // Should be 1
+print max(gappy); // Should be 8
+
+print "=== Test 9: Maps ===";
+var inventory = {"apples": 3, "pears": 5};
+inventory["plums"] = 7;
+inventory["apples"] = inventory["apples"] + 1;
+print inventory["apples"]; // Should be 4
+print len(inventory); // Should be 3
+print inventory["kiwis"]; // Should be nil
+remove(inventory, "pears");
+print has(inventory, "pears"); // Should be false
+
+print "=== Test 10: Classes ===";
+class Account {
+  init(owner) {
+    this.owner = owner;
+    this.balance = 0;
+  }
+
+  deposit(amount) {
+    this.balance = this.balance + amount;
+    return this;
+  }
+}
+var account = Account("Ada");
+account.deposit(50).deposit(25);
+print account.balance; // Should be 75
+print account.owner; // Should be Ada
+print account; // Should be Account instance
+
+print "=== Test 11: Integers ===";
+var big = 9007199254740993;
+print big - 1; // Should be 9007199254740992
+print 9223372036854775807 + 1; // Should be 9.223372036854776e+18
+print 7 / 2; // Should be 3.5
+print 17 % 5; // Should be 2
+print (12 & 10) | (1 << 4); // Should be 24
+print ~0 >> 1; // Should be -1
+print 3 == 3.0; // Should be true
+
+print "=== Test 12: String Slices ===";
+var logLine = "2024-01-05 ERROR disk full";
+var fields = split(logLine, " ");
+print len(fields); // Should be 4
+print fields[1] == "ERROR"; // Should be true
+print substr(logLine, 0, 4); // Should be 2024
+print indexOf(logLine, "disk"); // Should be 17
+print fields[2] + "!"; // Should be disk!
+
+print "=== Test 13: String Functions ===";
+print count("a,b,c", ","); // Should be 2
+print replace("a,b,c", ",", " | "); // Should be a | b | c
+print trim("   padded   ") == "padded"; // Should be true
+print startsWith("ERROR disk", "ERROR"); // Should be true
+
+print "=== Test 14: Isolates ===";
+var squarer = spawn("var n = receive(); send(0, [n, n * n]);");
+send(squarer, 12);
+print receive(); // Should be [12, 144]
+print send(squarer, clock); // Should be nil
+
+print "=== Test 15: Fibers ===";
+fun countTo(limit) {
+  var i = 1;
+  while (i < limit) { yield(i); i = i + 1; }
+  return limit;
+}
+var counting = fiber(countTo);
+var seen = 0;
+seen = seen + resume(counting, 3);
+seen = seen + resume(counting);
+seen = seen + resume(counting);
+print seen; // Should be 6
+print done(counting); // Should be true
+
+print "=== Test 16: Event Loop ===";
+var server = listen("127.0.0.1", 0);
+fun echoOnce(socket) {
+  var client = accept(socket);
+  write(client, read(client) + "!");
+  close(client);
+}
+resume(fiber(echoOnce), server);
+var socket = connect("127.0.0.1", localPort(server));
+write(socket, "pong");
+print read(socket); // Should be pong!
+print read(socket); // Should be nil
+close(socket);
+close(server);
+print read(1500000000); // Should be nil
+
+print "=== Test 17: Inlining ===";
+// Run with -O too: bodies that keep a local aren't inlined
+fun twice(x) { var unused = 1; return x * 2; }
+fun plusFive(x) { const k = 5; return x + k; }
+fun square(x) { return x * x; }
+print twice(3) + twice(4); // Should be 14
+print plusFive(1) + plusFive(2); // Should be 13
+print square(3) + square(4); // Should be 25
+
+print "=== Test 18: Isolates Waiting On Each Other ===";
+// More isolates block in receive() than the pool has threads at first
+fun relayAll(count) {
+  var ids = [];
+  var expected = 0;
+  var i = 0;
+  while (i < count) {
+    var id = spawn("var n = receive(); send(0, n * 2);");
+    append(ids, id);
+    expected = expected + id * 2;
+    i = i + 1;
+  }
+  var sender = spawn("var ids = receive(); var i = 0; while (i < len(ids)) { send(ids[i], ids[i]); i = i + 1; }");
+  send(sender, ids);
+  var total = 0;
+  i = 0;
+  while (i < count) { total = total + receive(); i = i + 1; }
+  return total == expected;
+}
+print relayAll(16); // Should be true
+
+print "=== Test 19: Printing Numbers ===";
+print 0.290131; // Should be 0.290131
+print 0.703261364; // Should be 0.703261364
+print 0.1 + 0.2; // Should be 0.30000000000000004
+print 1 / 3; // Should be 0.3333333333333333
+print 0.000015; // Should be 1.5e-05
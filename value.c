@@ -1,8 +1,10 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "object.h" 
 #include "memory.h"
+#include "number.h"
 #include "value.h"
 
 void initValueArray(ValueArray* array) {
@@ -11,33 +13,134 @@ void initValueArray(ValueArray* array) {
   array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+    array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
   }
 
   array->values[array->count] = value;
   array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   initValueArray(array);
 }
 
+bool toInteger(Value value, int64_t* result) {
+  if (IS_INT(value)) {
+    *result = AS_INT(value);
+    return true;
+  }
+  if (!IS_NUMBER(value)) return false;
+  double number = AS_NUMBER(value);
+  // -2^63 is exact as a double; 2^63 is the first value past the range
+  if (!(number >= -0x1p63 && number < 0x1p63)) return false;
+  *result = (int64_t)number;
+  return (double)*result == number;
+}
+
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) return false;
+  if (a.type != b.type) {
+    // Compared exactly: 2^53 + 1 isn't equal to the double 2^53
+    int64_t integer;
+    if (IS_INT(a) && IS_NUMBER(b)) return toInteger(b, &integer) && integer == AS_INT(a);
+    if (IS_NUMBER(a) && IS_INT(b)) return toInteger(a, &integer) && integer == AS_INT(b);
+    return false;
+  }
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_INT:    return AS_INT(a) == AS_INT(b);
+    case VAL_OBJ: {
+      if (AS_OBJ(a) == AS_OBJ(b)) return true;
+      if (!IS_STRING_LIKE(a) || !IS_STRING_LIKE(b)) return false;
+      if (IS_SLICE(a) || IS_SLICE(b)) {
+        return STRING_LENGTH(a) == STRING_LENGTH(b) &&
+               memcmp(STRING_CHARS(a), STRING_CHARS(b), STRING_LENGTH(a)) == 0;
+      }
+      // Long strings aren't always interned
+      ObjString* left = AS_STRING(a);
+      ObjString* right = AS_STRING(b);
+      return left->length > STRING_INTERN_MAX &&
+             left->length == right->length &&
+             (left->hash == 0 || right->hash == 0 ||
+              left->hash == right->hash) &&
+             memcmp(left->chars, right->chars, left->length) == 0;
+    }
     default:         return false; // Unreachable.
   }
 }
 
+Value addNumbers(Value a, Value b) {
+  int64_t result;
+  if (IS_INT(a) && IS_INT(b) &&
+      !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result)) {
+    return INT_VAL(result);
+  }
+  return NUMBER_VAL(TO_DOUBLE(a) + TO_DOUBLE(b));
+}
+
+Value subtractNumbers(Value a, Value b) {
+  int64_t result;
+  if (IS_INT(a) && IS_INT(b) &&
+      !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result)) {
+    return INT_VAL(result);
+  }
+  return NUMBER_VAL(TO_DOUBLE(a) - TO_DOUBLE(b));
+}
+
+Value multiplyNumbers(Value a, Value b) {
+  int64_t result;
+  if (IS_INT(a) && IS_INT(b) &&
+      !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result)) {
+    return INT_VAL(result);
+  }
+  return NUMBER_VAL(TO_DOUBLE(a) * TO_DOUBLE(b));
+}
+
+Value divideNumbers(Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b)) {
+    int64_t x = AS_INT(a);
+    int64_t y = AS_INT(b);
+    // INT64_MIN / -1 is the one quotient that overflows
+    if (y != 0 && !(y == -1 && x == INT64_MIN) && x % y == 0) {
+      return INT_VAL(x / y);
+    }
+  }
+  return NUMBER_VAL(TO_DOUBLE(a) / TO_DOUBLE(b));
+}
+
+Value moduloNumbers(Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0) {
+    // Also sidesteps INT64_MIN % -1, which traps on x86
+    if (AS_INT(b) == -1) return INT_VAL(0);
+    return INT_VAL(AS_INT(a) % AS_INT(b));
+  }
+  return NUMBER_VAL(fmod(TO_DOUBLE(a), TO_DOUBLE(b)));
+}
+
+Value negateNumber(Value a) {
+  if (IS_INT(a) && AS_INT(a) != INT64_MIN) return INT_VAL(-AS_INT(a));
+  return NUMBER_VAL(-TO_DOUBLE(a));
+}
+
+int64_t shiftLeft(int64_t value, int64_t count) {
+  if (count < 0) return shiftRight(value, count == INT64_MIN ? INT64_MAX : -count);
+  if (count >= 64) return 0;
+  return (int64_t)((uint64_t)value << count);
+}
+
+int64_t shiftRight(int64_t value, int64_t count) {
+  if (count < 0) return shiftLeft(value, count == INT64_MIN ? INT64_MAX : -count);
+  // Arithmetic shift: the sign bit fills in from the left
+  if (count >= 64) return value < 0 ? -1 : 0;
+  return value >> count;
+}
+
 
 void printValue(Value value) {
   switch (value.type) {
@@ -47,9 +150,18 @@ void printValue(Value value) {
     case VAL_NIL:
       printf("nil");
       break;
-    case VAL_NUMBER:
-      printf("%g", AS_NUMBER(value));
+    case VAL_NUMBER: {
+      char buffer[NUMBER_BUFFER_SIZE];
+      int length = formatNumber(AS_NUMBER(value), buffer);
+      fwrite(buffer, 1, length, stdout);
+      break;
+    }
+    case VAL_INT: {
+      char buffer[NUMBER_BUFFER_SIZE];
+      int length = formatInt(AS_INT(value), buffer);
+      fwrite(buffer, 1, length, stdout);
       break;
+    }
     case VAL_OBJ:
       printObject(value);
       break;
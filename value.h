@@ -10,6 +10,7 @@ typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
+  VAL_INT,
   VAL_OBJ
 } ValueType;
 
@@ -18,6 +19,7 @@ typedef struct {
   union {
     bool boolean;
     double number;
+    int64_t integer;
     Obj* obj;
   } as;
 } Value;
@@ -26,17 +28,24 @@ typedef struct {
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 // Macros for unpacking values
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
+// Either kind of number, as a double
+#define TO_DOUBLE(value) \
+    (IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value))
 
 // Macros for creating values
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 // Array of values
@@ -48,10 +57,28 @@ typedef struct {
 
 // Function prototypes
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
 void printValue(Value value);
 
 bool valuesEqual(Value a, Value b);
 
+// Arithmetic on two numeric values. Integers stay integers unless the
+// result overflows, or for division isn't whole, in which case it's
+// computed in doubles instead. A double on either side makes a double.
+Value addNumbers(Value a, Value b);
+Value subtractNumbers(Value a, Value b);
+Value multiplyNumbers(Value a, Value b);
+Value divideNumbers(Value a, Value b);
+Value moduloNumbers(Value a, Value b); // Takes the sign of 'a', like fmod
+Value negateNumber(Value a);
+
+// Integers, and doubles holding a whole number in int64 range
+bool toInteger(Value value, int64_t* result);
+
+// Bit shifts on 64 bits. Bits shifted out are lost, counts of 64 or more
+// shift everything out, and negative counts shift the other way.
+int64_t shiftLeft(int64_t value, int64_t count);
+int64_t shiftRight(int64_t value, int64_t count);
+
 #endif
\ No newline at end of file
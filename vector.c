@@ -0,0 +1,332 @@
+#define _GNU_SOURCE // memmem()
+#include <string.h>
+
+#include "vector.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VECTOR_AVX2
+#endif
+
+#ifdef VECTOR_AVX2
+// Set once at startup, before any thread can call a kernel
+static bool avx2Supported;
+
+__attribute__((constructor))
+static void detectAvx2() {
+  __builtin_cpu_init();
+  avx2Supported = __builtin_cpu_supports("avx2");
+}
+
+static bool hasAvx2() {
+  return avx2Supported;
+}
+
+// Four lanes, four accumulators: 16 doubles per iteration keeps the
+// adder busy instead of waiting on one dependency chain.
+
+__attribute__((target("avx2")))
+static double sumAvx2(const double* a, int count) {
+  __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  __m256d acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+    acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    acc2 = _mm256_add_pd(acc2, _mm256_loadu_pd(a + i + 8));
+    acc3 = _mm256_add_pd(acc3, _mm256_loadu_pd(a + i + 12));
+  }
+  for (; i + 4 <= count; i += 4) {
+    acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(acc0, acc1),
+                                        _mm256_add_pd(acc2, acc3)));
+  double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < count; i++) sum += a[i];
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static double dotAvx2(const double* a, const double* b, int count) {
+  __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  __m256d acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                             _mm256_loadu_pd(b + i)));
+    acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                             _mm256_loadu_pd(b + i + 4)));
+    acc2 = _mm256_add_pd(acc2, _mm256_mul_pd(_mm256_loadu_pd(a + i + 8),
+                                             _mm256_loadu_pd(b + i + 8)));
+    acc3 = _mm256_add_pd(acc3, _mm256_mul_pd(_mm256_loadu_pd(a + i + 12),
+                                             _mm256_loadu_pd(b + i + 12)));
+  }
+  for (; i + 4 <= count; i += 4) {
+    acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                             _mm256_loadu_pd(b + i)));
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(acc0, acc1),
+                                        _mm256_add_pd(acc2, acc3)));
+  double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < count; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static double minAvx2(const double* a, int count) {
+  __m256d best = _mm256_set1_pd(a[0]);
+  int i = 0;
+  // min_pd returns its second operand when either is NaN, so NaN
+  // elements are skipped as in the scalar loop
+  for (; i + 4 <= count; i += 4) best = _mm256_min_pd(_mm256_loadu_pd(a + i), best);
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, best);
+  double result = lanes[0];
+  for (int lane = 1; lane < 4; lane++) if (lanes[lane] < result) result = lanes[lane];
+  for (; i < count; i++) if (a[i] < result) result = a[i];
+  return result;
+}
+
+__attribute__((target("avx2")))
+static double maxAvx2(const double* a, int count) {
+  __m256d best = _mm256_set1_pd(a[0]);
+  int i = 0;
+  // max_pd returns its second operand when either is NaN, so NaN
+  // elements are skipped as in the scalar loop
+  for (; i + 4 <= count; i += 4) best = _mm256_max_pd(_mm256_loadu_pd(a + i), best);
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, best);
+  double result = lanes[0];
+  for (int lane = 1; lane < 4; lane++) if (lanes[lane] > result) result = lanes[lane];
+  for (; i < count; i++) if (a[i] > result) result = a[i];
+  return result;
+}
+
+__attribute__((target("avx2")))
+static void scaleAvx2(double* out, const double* a, double factor, int count) {
+  __m256d k = _mm256_set1_pd(factor);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), k));
+  }
+  for (; i < count; i++) out[i] = a[i] * factor;
+}
+
+__attribute__((target("avx2")))
+static void addAvx2(double* out, const double* a, const double* b, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  }
+  for (; i < count; i++) out[i] = a[i] + b[i];
+}
+
+__attribute__((target("avx2")))
+static void mulAvx2(double* out, const double* a, const double* b, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  }
+  for (; i < count; i++) out[i] = a[i] * b[i];
+}
+
+// In-register scan of four lanes: add the vector shifted up by one lane,
+// then by two, then the running total carried in from the last block.
+__attribute__((target("avx2")))
+static void prefixSumAvx2(double* out, const double* a, int count) {
+  __m256d zero = _mm256_setzero_pd();
+  __m256d carry = zero;
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    __m256d shifted = _mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0));
+    x = _mm256_add_pd(x, _mm256_blend_pd(shifted, zero, 0x1));
+    shifted = _mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0));
+    x = _mm256_add_pd(x, _mm256_blend_pd(shifted, zero, 0x3));
+    x = _mm256_add_pd(x, carry);
+    _mm256_storeu_pd(out + i, x);
+    carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+
+  double total = i > 0 ? out[i - 1] : 0;
+  for (; i < count; i++) {
+    total += a[i];
+    out[i] = total;
+  }
+}
+
+// Compares 32 positions at a time against the needle's first and last
+// bytes, and only checks the rest where both match (Mula's filter).
+// 'needleLength' is at least 2 and 'length' at least 'needleLength'.
+__attribute__((target("avx2")))
+static int findAvx2(const char* haystack, int length, const char* needle,
+                    int needleLength) {
+  __m256i first = _mm256_set1_epi8(needle[0]);
+  __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+  int i = 0;
+  for (; i + needleLength - 1 + 32 <= length; i += 32) {
+    __m256i blockFirst = _mm256_loadu_si256((const __m256i*)(haystack + i));
+    __m256i blockLast = _mm256_loadu_si256(
+        (const __m256i*)(haystack + i + needleLength - 1));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+    while (mask != 0) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(haystack + i + bit + 1, needle + 1, needleLength - 2) == 0) {
+        return i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  for (; i + needleLength <= length; i++) {
+    if (haystack[i] == needle[0] &&
+        memcmp(haystack + i, needle, needleLength) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+__attribute__((target("avx2")))
+static int countByteAvx2(const char* haystack, int length, char byte) {
+  __m256i target = _mm256_set1_epi8(byte);
+  int count = 0;
+  int i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(haystack + i));
+    count += __builtin_popcount(
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, target)));
+  }
+  for (; i < length; i++) count += haystack[i] == byte;
+  return count;
+}
+#endif
+
+double f64Sum(const double* a, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) return sumAvx2(a, count);
+#endif
+  double sum = 0;
+  for (int i = 0; i < count; i++) sum += a[i];
+  return sum;
+}
+
+double f64Dot(const double* a, const double* b, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) return dotAvx2(a, b, count);
+#endif
+  double sum = 0;
+  for (int i = 0; i < count; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+double f64Min(const double* a, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) return minAvx2(a, count);
+#endif
+  double result = a[0];
+  for (int i = 1; i < count; i++) if (a[i] < result) result = a[i];
+  return result;
+}
+
+double f64Max(const double* a, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) return maxAvx2(a, count);
+#endif
+  double result = a[0];
+  for (int i = 1; i < count; i++) if (a[i] > result) result = a[i];
+  return result;
+}
+
+void f64Scale(double* out, const double* a, double factor, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) {
+    scaleAvx2(out, a, factor, count);
+    return;
+  }
+#endif
+  for (int i = 0; i < count; i++) out[i] = a[i] * factor;
+}
+
+void f64Add(double* out, const double* a, const double* b, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) {
+    addAvx2(out, a, b, count);
+    return;
+  }
+#endif
+  for (int i = 0; i < count; i++) out[i] = a[i] + b[i];
+}
+
+void f64Mul(double* out, const double* a, const double* b, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) {
+    mulAvx2(out, a, b, count);
+    return;
+  }
+#endif
+  for (int i = 0; i < count; i++) out[i] = a[i] * b[i];
+}
+
+void f64PrefixSum(double* out, const double* a, int count) {
+#ifdef VECTOR_AVX2
+  if (hasAvx2()) {
+    prefixSumAvx2(out, a, count);
+    return;
+  }
+#endif
+  double total = 0;
+  for (int i = 0; i < count; i++) {
+    total += a[i];
+    out[i] = total;
+  }
+}
+
+int findBytes(const char* haystack, int length, int from,
+              const char* needle, int needleLength) {
+  if (from < 0 || from > length - needleLength) return -1;
+  if (needleLength == 0) return from;
+  const char* start = haystack + from;
+  int remaining = length - from;
+
+  const char* found;
+  if (needleLength == 1) {
+    found = memchr(start, needle[0], remaining);
+#ifdef VECTOR_AVX2
+  } else if (needleLength <= BYTES_FILTER_MAX && hasAvx2()) {
+    int offset = findAvx2(start, remaining, needle, needleLength);
+    return offset == -1 ? -1 : from + offset;
+#endif
+  } else {
+    found = memmem(start, remaining, needle, needleLength);
+  }
+  return found == NULL ? -1 : (int)(found - haystack);
+}
+
+int countBytes(const char* haystack, int length, const char* needle,
+               int needleLength) {
+  if (needleLength == 1) {
+#ifdef VECTOR_AVX2
+    if (hasAvx2()) return countByteAvx2(haystack, length, needle[0]);
+#endif
+    int count = 0;
+    for (int i = 0; i < length; i++) count += haystack[i] == needle[0];
+    return count;
+  }
+
+  int count = 0;
+  int at = findBytes(haystack, length, 0, needle, needleLength);
+  while (at != -1) {
+    count++;
+    at = findBytes(haystack, length, at + needleLength, needle, needleLength);
+  }
+  return count;
+}
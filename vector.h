@@ -0,0 +1,35 @@
+#ifndef asharp_vector_h
+#define asharp_vector_h
+
+#include "common.h"
+
+// Bulk kernels over packed doubles, used by the Float64Array natives.
+// Each one uses AVX2 when the CPU has it and a scalar loop otherwise.
+// The vector sums add in a different order, so they can differ from the
+// scalar ones in the last bits.
+
+double f64Sum(const double* a, int count);
+double f64Dot(const double* a, const double* b, int count);
+double f64Min(const double* a, int count); // 'count' must be at least 1
+double f64Max(const double* a, int count); // 'count' must be at least 1
+void f64Scale(double* out, const double* a, double factor, int count);
+void f64Add(double* out, const double* a, const double* b, int count);
+void f64Mul(double* out, const double* a, const double* b, int count);
+void f64PrefixSum(double* out, const double* a, int count);
+
+// Byte-string search, used by the string natives. Needles up to
+// BYTES_FILTER_MAX bytes are found with an AVX2 filter; longer ones, and
+// every needle on CPUs without AVX2, go to memchr() or memmem(). glibc's
+// memmem() uses the two-way algorithm, which stays linear however
+// repetitive the text is.
+#define BYTES_FILTER_MAX 32
+
+// Offset of the first 'needle' in 'haystack' at or after 'from', or -1.
+// An empty needle is found at 'from'.
+int findBytes(const char* haystack, int length, int from,
+              const char* needle, int needleLength);
+// Non-overlapping occurrences of 'needle', which must not be empty
+int countBytes(const char* haystack, int length, const char* needle,
+               int needleLength);
+
+#endif
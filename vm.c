@@ -1,44 +1,361 @@
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <math.h> 
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "isolate.h"
 #include "object.h"
 #include "memory.h"
+#include "snapshot.h"
+#include "vector.h"
 #include "vm.h"
 
-VM vm; 
-
 // --- Native Functions ---
-static Value clockNative(int argCount, Value* args) {
+static Value clockNative(VM* vm, int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static Value sqrtNative(int argCount, Value* args) {
-  if (argCount != 1 || !IS_NUMBER(args[0])) return NIL_VAL;
-  return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+static Value sqrtNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_NUMERIC(args[0])) return NIL_VAL;
+  return NUMBER_VAL(sqrt(TO_DOUBLE(args[0])));
 }
 
-static Value floorNative(int argCount, Value* args) {
-  if (argCount != 1 || !IS_NUMBER(args[0])) return NIL_VAL;
-  return NUMBER_VAL(floor(AS_NUMBER(args[0])));
+// Whole results come back as integers when they fit
+static Value floorNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_NUMERIC(args[0])) return NIL_VAL;
+  if (IS_INT(args[0])) return args[0];
+  Value result = NUMBER_VAL(floor(AS_NUMBER(args[0])));
+  int64_t integer;
+  return toInteger(result, &integer) ? INT_VAL(integer) : result;
 }
 
 //Native Function for power operations
-//Later Caret (^) can be added as power operator
-static Value powNative(int argCount, Value* args) {
-  if (argCount != 2 || !IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return NIL_VAL;
-  return NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+static Value powNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_NUMERIC(args[0]) || !IS_NUMERIC(args[1])) return NIL_VAL;
+  return NUMBER_VAL(pow(TO_DOUBLE(args[0]), TO_DOUBLE(args[1])));
+}
+
+static Value lenNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1) return NIL_VAL;
+  if (IS_LIST(args[0])) return INT_VAL(AS_LIST(args[0])->items.count);
+  if (IS_FLOAT_ARRAY(args[0])) return INT_VAL(AS_FLOAT_ARRAY(args[0])->count);
+  if (IS_MAP(args[0])) return INT_VAL(AS_MAP(args[0])->table.count);
+  if (IS_STRING_LIKE(args[0])) return INT_VAL(STRING_LENGTH(args[0]));
+  return NIL_VAL;
+}
+
+// Map keys are strings and numbers other than NaN. Long strings are
+// interned here, since tables compare string keys by identity, slices are
+// copied into strings, and whole doubles become integers so that 1 and 1.0
+// are the same key.
+static bool mapKey(VM* vm, Value key, Value* result) {
+  if (IS_STRING(key)) {
+    *result = OBJ_VAL(internString(vm, AS_STRING(key)));
+    return true;
+  }
+  if (IS_SLICE(key)) {
+    ObjString* string = copyString(vm, STRING_CHARS(key), STRING_LENGTH(key));
+    *result = OBJ_VAL(internString(vm, string));
+    return true;
+  }
+  int64_t integer;
+  if (toInteger(key, &integer)) {
+    *result = INT_VAL(integer);
+    return true;
+  }
+  if (IS_NUMBER(key) && !isnan(AS_NUMBER(key))) {
+    *result = key;
+    return true;
+  }
+  return false;
+}
+
+// keys(map) and values(map) list the entries in the same (arbitrary) order
+static Value keysNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_MAP(args[0])) return NIL_VAL;
+  Table* table = &AS_MAP(args[0])->table;
+  ObjList* list = newList(vm);
+  for (int i = 0; i < table->capacity; i++) {
+    if (!IS_NIL(table->entries[i].key)) {
+      writeValueArray(vm, &list->items, table->entries[i].key);
+    }
+  }
+  return OBJ_VAL(list);
+}
+
+static Value valuesNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_MAP(args[0])) return NIL_VAL;
+  Table* table = &AS_MAP(args[0])->table;
+  ObjList* list = newList(vm);
+  for (int i = 0; i < table->capacity; i++) {
+    if (!IS_NIL(table->entries[i].key)) {
+      writeValueArray(vm, &list->items, table->entries[i].value);
+    }
+  }
+  return OBJ_VAL(list);
+}
+
+static Value hasNative(VM* vm, int argCount, Value* args) {
+  Value key, value;
+  if (argCount != 2 || !IS_MAP(args[0]) || !mapKey(vm, args[1], &key)) {
+    return NIL_VAL;
+  }
+  return BOOL_VAL(tableGetValue(&AS_MAP(args[0])->table, key, &value));
+}
+
+// remove(map, key) returns whether the key was there
+static Value removeNative(VM* vm, int argCount, Value* args) {
+  Value key;
+  if (argCount != 2 || !IS_MAP(args[0]) || !mapKey(vm, args[1], &key)) {
+    return NIL_VAL;
+  }
+  return BOOL_VAL(tableDeleteValue(vm, &AS_MAP(args[0])->table, key));
+}
+
+// append(list, value) adds to the end of the list and returns the list
+static Value appendNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_LIST(args[0])) return NIL_VAL;
+  writeValueArray(vm, &AS_LIST(args[0])->items, args[1]);
+  return args[0];
+}
+
+// --- String natives ---
+// Strings and slices are accepted alike, and parts of a string come back
+// as slices of it, so nothing is copied. Searches run on the byte kernels
+// in vector.c.
+
+// 'length' characters of 'string' from 'start', which must be in range
+static Value substring(VM* vm, Value string, int start, int length) {
+  if (IS_STRING(string)) {
+    if (start == 0 && length == AS_STRING(string)->length) return string;
+    return OBJ_VAL(newSlice(vm, AS_STRING(string), start, length));
+  }
+  ObjSlice* slice = AS_SLICE(string);
+  return OBJ_VAL(newSlice(vm, slice->parent, slice->start + start, length));
+}
+
+// substr(s, start) and substr(s, start, length). The length is cut short
+// at the end of the string.
+static Value substrNative(VM* vm, int argCount, Value* args) {
+  int64_t start, length;
+  if (argCount < 2 || argCount > 3 || !IS_STRING_LIKE(args[0]) ||
+      !toInteger(args[1], &start)) {
+    return NIL_VAL;
+  }
+  int size = STRING_LENGTH(args[0]);
+  if (start < 0 || start > size) return NIL_VAL;
+  if (argCount == 2) {
+    length = size - start;
+  } else if (!toInteger(args[2], &length) || length < 0) {
+    return NIL_VAL;
+  }
+  if (length > size - start) length = size - start;
+  return substring(vm, args[0], (int)start, (int)length);
+}
+
+// indexOf(s, needle) and indexOf(s, needle, from) give -1 if not found
+static Value indexOfNative(VM* vm, int argCount, Value* args) {
+  int64_t from = 0;
+  if (argCount < 2 || argCount > 3 || !IS_STRING_LIKE(args[0]) ||
+      !IS_STRING_LIKE(args[1]) ||
+      (argCount == 3 && (!toInteger(args[2], &from) || from < 0))) {
+    return NIL_VAL;
+  }
+  int length = STRING_LENGTH(args[0]);
+  if (from > length) return INT_VAL(-1);
+  return INT_VAL(findBytes(STRING_CHARS(args[0]), length, (int)from,
+                            STRING_CHARS(args[1]), STRING_LENGTH(args[1])));
+}
+
+// split(s, separator) lists the parts between separators, which must not
+// be empty
+static Value splitNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_STRING_LIKE(args[0]) ||
+      !IS_STRING_LIKE(args[1]) || STRING_LENGTH(args[1]) == 0) {
+    return NIL_VAL;
+  }
+  const char* chars = STRING_CHARS(args[0]);
+  int length = STRING_LENGTH(args[0]);
+  const char* separator = STRING_CHARS(args[1]);
+  int separatorLength = STRING_LENGTH(args[1]);
+
+  ObjList* list = newList(vm);
+  int start = 0;
+  for (;;) {
+    int found = findBytes(chars, length, start, separator, separatorLength);
+    int end = found == -1 ? length : found;
+    writeValueArray(vm, &list->items, substring(vm, args[0], start, end - start));
+    if (found == -1) break;
+    start = found + separatorLength;
+  }
+  return OBJ_VAL(list);
+}
+
+// count(s, needle) counts non-overlapping occurrences of a non-empty needle
+static Value countNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_STRING_LIKE(args[0]) ||
+      !IS_STRING_LIKE(args[1]) || STRING_LENGTH(args[1]) == 0) {
+    return NIL_VAL;
+  }
+  return INT_VAL(countBytes(STRING_CHARS(args[0]), STRING_LENGTH(args[0]),
+                            STRING_CHARS(args[1]), STRING_LENGTH(args[1])));
+}
+
+// replace(s, old, new) replaces every non-overlapping 'old', which must not
+// be empty. 's' itself comes back if there's nothing to replace.
+static Value replaceNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 3 || !IS_STRING_LIKE(args[0]) || !IS_STRING_LIKE(args[1]) ||
+      !IS_STRING_LIKE(args[2]) || STRING_LENGTH(args[1]) == 0) {
+    return NIL_VAL;
+  }
+  const char* chars = STRING_CHARS(args[0]);
+  int length = STRING_LENGTH(args[0]);
+  const char* from = STRING_CHARS(args[1]);
+  int fromLength = STRING_LENGTH(args[1]);
+  const char* to = STRING_CHARS(args[2]);
+  int toLength = STRING_LENGTH(args[2]);
+
+  int count = countBytes(chars, length, from, fromLength);
+  if (count == 0) return args[0];
+
+  int resultLength = length + count * (toLength - fromLength);
+  char* result = ALLOCATE(vm, char, resultLength + 1);
+  char* out = result;
+  int start = 0;
+  for (int found; (found = findBytes(chars, length, start, from, fromLength)) != -1;
+       start = found + fromLength) {
+    memcpy(out, chars + start, found - start);
+    out += found - start;
+    memcpy(out, to, toLength);
+    out += toLength;
+  }
+  memcpy(out, chars + start, length - start);
+  result[resultLength] = '\0';
+  return OBJ_VAL(takeString(vm, result, resultLength));
+}
+
+// trim(s) drops leading and trailing whitespace
+static Value trimNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_STRING_LIKE(args[0])) return NIL_VAL;
+  const char* chars = STRING_CHARS(args[0]);
+  int start = 0;
+  int end = STRING_LENGTH(args[0]);
+  while (start < end && isspace((unsigned char)chars[start])) start++;
+  while (end > start && isspace((unsigned char)chars[end - 1])) end--;
+  return substring(vm, args[0], start, end - start);
+}
+
+static Value startsWithNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_STRING_LIKE(args[0]) || !IS_STRING_LIKE(args[1])) {
+    return NIL_VAL;
+  }
+  int length = STRING_LENGTH(args[1]);
+  return BOOL_VAL(length <= STRING_LENGTH(args[0]) &&
+                  memcmp(STRING_CHARS(args[0]), STRING_CHARS(args[1]), length) == 0);
+}
+
+// --- Float64Array natives ---
+// These hand whole arrays to the kernels in vector.c. Like the other
+// natives they return nil on bad arguments, including arrays whose
+// lengths don't match.
+
+// floatArray(n) makes n zeros; floatArray(list) copies a list of numbers
+static Value floatArrayNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1) return NIL_VAL;
+
+  int64_t count;
+  if (toInteger(args[0], &count)) {
+    if (count < 0 || count > INT32_MAX) return NIL_VAL;
+    return OBJ_VAL(newFloatArray(vm, (int)count));
+  }
+
+  if (!IS_LIST(args[0])) return NIL_VAL;
+  ValueArray* items = &AS_LIST(args[0])->items;
+  for (int i = 0; i < items->count; i++) {
+    if (!IS_NUMERIC(items->values[i])) return NIL_VAL;
+  }
+  ObjFloatArray* array = newFloatArray(vm, items->count);
+  for (int i = 0; i < items->count; i++) {
+    array->values[i] = TO_DOUBLE(items->values[i]);
+  }
+  return OBJ_VAL(array);
+}
+
+static bool sameLength(Value a, Value b) {
+  return IS_FLOAT_ARRAY(a) && IS_FLOAT_ARRAY(b) &&
+         AS_FLOAT_ARRAY(a)->count == AS_FLOAT_ARRAY(b)->count;
+}
+
+static Value sumNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_FLOAT_ARRAY(args[0])) return NIL_VAL;
+  ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+  return NUMBER_VAL(f64Sum(array->values, array->count));
+}
+
+static Value dotNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !sameLength(args[0], args[1])) return NIL_VAL;
+  ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+  return NUMBER_VAL(f64Dot(a->values, AS_FLOAT_ARRAY(args[1])->values, a->count));
+}
+
+static Value minNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_FLOAT_ARRAY(args[0])) return NIL_VAL;
+  ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+  if (array->count == 0) return NIL_VAL;
+  return NUMBER_VAL(f64Min(array->values, array->count));
+}
+
+static Value maxNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_FLOAT_ARRAY(args[0])) return NIL_VAL;
+  ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+  if (array->count == 0) return NIL_VAL;
+  return NUMBER_VAL(f64Max(array->values, array->count));
+}
+
+static Value scaleNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_FLOAT_ARRAY(args[0]) || !IS_NUMERIC(args[1])) {
+    return NIL_VAL;
+  }
+  ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+  ObjFloatArray* result = newFloatArray(vm, a->count);
+  f64Scale(result->values, a->values, TO_DOUBLE(args[1]), a->count);
+  return OBJ_VAL(result);
+}
+
+static Value addNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !sameLength(args[0], args[1])) return NIL_VAL;
+  ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+  ObjFloatArray* result = newFloatArray(vm, a->count);
+  f64Add(result->values, a->values, AS_FLOAT_ARRAY(args[1])->values, a->count);
+  return OBJ_VAL(result);
+}
+
+static Value mulNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !sameLength(args[0], args[1])) return NIL_VAL;
+  ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+  ObjFloatArray* result = newFloatArray(vm, a->count);
+  f64Mul(result->values, a->values, AS_FLOAT_ARRAY(args[1])->values, a->count);
+  return OBJ_VAL(result);
+}
+
+static Value prefixSumNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_FLOAT_ARRAY(args[0])) return NIL_VAL;
+  ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+  ObjFloatArray* result = newFloatArray(vm, a->count);
+  f64PrefixSum(result->values, a->values, a->count);
+  return OBJ_VAL(result);
 }
 
-static Value inputNative(int argCount, Value* args) {
-  if (argCount > 0 && IS_STRING(args[0])) {
-    printf("%s", AS_STRING(args[0])->chars);
+static Value inputNative(VM* vm, int argCount, Value* args) {
+  if (argCount > 0 && IS_STRING_LIKE(args[0])) {
+    fwrite(STRING_CHARS(args[0]), 1, STRING_LENGTH(args[0]), stdout);
   }
   char buffer[1024];
   if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
@@ -47,77 +364,453 @@ static Value inputNative(int argCount, Value* args) {
       buffer[length - 1] = '\0';
       length--;
     }
-    return OBJ_VAL(copyString(buffer, (int)length));
+    return OBJ_VAL(copyString(vm, buffer, (int)length));
   }
   return NIL_VAL;
 }
 
-static void resetStack() {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
+// Makes run() execute 'fiber', or the main script if it is NULL. The
+// caller sets frameCount and stackTop.
+static void loadFiber(VM* vm, ObjFiber* fiber) {
+  vm->fiber = fiber;
+  vm->switched = true;
+  if (fiber == NULL) {
+    vm->frames = vm->mainFrames;
+    vm->stack = vm->mainStack;
+    vm->stackLimit = vm->mainStack + STACK_MAX;
+  } else {
+    vm->frames = fiber->frames;
+    vm->stack = fiber->stack;
+    vm->stackLimit = fiber->stack + FIBER_STACK_MAX;
+  }
+}
+
+static void resetStack(VM* vm) {
+  loadFiber(vm, NULL);
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
 
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm.frames[i];
-    ObjFunction* function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", 
-            function->chunk.lines[instruction]);
-    if (function->name == NULL) {
-      fprintf(stderr, "script\n");
-    } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+  // The running fiber's frames, then those of each fiber that resumed it.
+  // None of them can carry on.
+  ObjFiber* fiber = vm->fiber;
+  CallFrame* frames = vm->frames;
+  int frameCount = vm->frameCount;
+  for (;;) {
+    for (int i = frameCount - 1; i >= 0; i--) {
+      CallFrame* frame = &frames[i];
+      ObjFunction* function = frame->closure->function;
+      size_t instruction = frame->ip - function->chunk.code - 1;
+      fprintf(stderr, "[line %d] in ", 
+              function->chunk.lines[instruction]);
+      if (function->name == NULL) {
+        fprintf(stderr, "script\n");
+      } else {
+        fprintf(stderr, "%s()\n", function->name->chars);
+      }
     }
+    if (fiber == NULL) break;
+    fiber->state = FIBER_DONE;
+    if (fiber->fromLoop) break; // Nothing called it
+    frameCount = fiber->callerFrameCount;
+    fiber = fiber->caller;
+    frames = fiber == NULL ? vm->mainFrames : fiber->frames;
   }
-  resetStack();
+  cancelWaits(vm);
+  resetStack(vm);
 }
 
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
-  pop();
+// --- Isolates ---
+// spawn(source) runs a script in a new isolate and returns its id; the
+// main script is isolate 0. Messages are copies, so only nil, booleans,
+// numbers, strings, lists, maps and Float64Arrays can be sent.
+
+static Value spawnNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_STRING_LIKE(args[0])) return NIL_VAL;
+  int id = spawnIsolate(STRING_CHARS(args[0]), STRING_LENGTH(args[0]));
+  return id < 0 ? NIL_VAL : INT_VAL(id);
 }
 
-void initVM() {
-  resetStack();
-  vm.objects = NULL;
-  initTable(&vm.strings);
-  initTable(&vm.globals);
+// send(id, value) returns true, or nil if the value can't be sent
+static Value sendNative(VM* vm, int argCount, Value* args) {
+  int64_t id;
+  if (argCount != 2 || !toInteger(args[0], &id) || id < 0 ||
+      id >= ISOLATES_MAX || !sendMessage((int)id, args[1])) {
+    return NIL_VAL;
+  }
+  return BOOL_VAL(true);
+}
 
-  defineNative("clock", clockNative); //Supporting time
-  defineNative("sqrt", sqrtNative); //Supporting Square root
-  defineNative("floor", floorNative); // Supporting floor op
-  defineNative("input", inputNative); //Taking Input form the user
-  defineNative("pow", powNative); //Power Operator;
+// receive() waits for the next message to this isolate
+static Value receiveNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 0) return NIL_VAL;
+  return receiveMessage(vm, vm->isolate);
 }
 
-void freeVM() {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
-  freeObjects();
+// --- Fibers ---
+// resume(), yield() and natives that wait on the event loop switch to
+// other code. A native that does that leaves both stacks the way they
+// should be itself: it drops its own call from the stack it was called
+// on, and pushes the value it passes on onto the one it switches to.
+// callValue() sees vm->switched and doesn't push again.
+
+// fiber(fn) makes a fiber that will call 'fn' with the first value it is
+// resumed with, if 'fn' takes one
+static Value fiberNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_CLOSURE(args[0])) return NIL_VAL;
+  ObjClosure* closure = AS_CLOSURE(args[0]);
+  ObjFunction* function = closure->function;
+  if (function->lazySource != NULL && !compileLazyFunction(vm, function)) {
+    return NIL_VAL;
+  }
+  if (function->arity > 1 || function->maxSlots > FIBER_STACK_MAX) {
+    return NIL_VAL;
+  }
+  return OBJ_VAL(newFiber(vm, closure));
 }
 
-void push(Value value) {
-  *vm.stackTop = value;
-  vm.stackTop++;
+// Switches from 'fiber' back to whatever resumed it, where 'value' is
+// what resume() returns
+static void returnToCaller(VM* vm, ObjFiber* fiber, Value value) {
+  loadFiber(vm, fiber->caller);
+  vm->frameCount = fiber->callerFrameCount;
+  vm->stackTop = fiber->callerStackTop;
+  fiber->caller = NULL;
+  push(vm, value);
 }
 
-Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+// resume(fiber, value) runs the fiber until it yields or returns, and
+// gives back what it yielded or returned. Returns nil at once for a
+// fiber that is running or done.
+static Value resumeNative(VM* vm, int argCount, Value* args) {
+  if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) return NIL_VAL;
+  ObjFiber* fiber = AS_FIBER(args[0]);
+  if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+    return NIL_VAL;
+  }
+  Value value = argCount == 2 ? args[1] : NIL_VAL;
+
+  vm->stackTop -= argCount + 1;
+  fiber->fromLoop = false;
+  fiber->caller = vm->fiber;
+  fiber->callerFrameCount = vm->frameCount;
+  fiber->callerStackTop = vm->stackTop;
+
+  loadFiber(vm, fiber);
+  vm->frameCount = fiber->frameCount;
+  vm->stackTop = fiber->stackTop;
+  // The value is the function's argument the first time, and what
+  // yield() returns after that
+  if (fiber->state == FIBER_SUSPENDED || fiber->closure->function->arity == 1) {
+    push(vm, value);
+  }
+  fiber->state = FIBER_RUNNING;
+  return NIL_VAL;
+}
+
+// Switches to the next code whose wait has finished, which gets the
+// waiter's result. False if nothing is waiting any more.
+static bool schedule(VM* vm) {
+  Waiter* waiter = nextReady(vm);
+  if (waiter == NULL) return false;
+
+  ObjFiber* fiber = waiter->fiber;
+  loadFiber(vm, fiber);
+  vm->frameCount = waiter->frameCount;
+  vm->stackTop = waiter->stackTop;
+  push(vm, waiter->result);
+  if (fiber != NULL) {
+    fiber->state = FIBER_RUNNING;
+    fiber->fromLoop = true;
+    fiber->caller = NULL;
+  }
+  free(waiter);
+  return true;
 }
 
-static Value peek(int distance) {
-  return vm.stackTop[-1 - distance];
+// Returns the result of a native's I/O if it finished at once. If not,
+// parks the code that called the native until it does and runs
+// something else: a fiber's resumer, as if the fiber had yielded nil,
+// or whatever the event loop has ready.
+static Value waitFor(VM* vm, Waiter* waiter, int argCount) {
+  if (!startWait(vm, waiter)) {
+    Value result = waiter->result;
+    free(waiter);
+    return result;
+  }
+
+  vm->stackTop -= argCount + 1;
+  waiter->fiber = vm->fiber;
+  waiter->frameCount = vm->frameCount;
+  waiter->stackTop = vm->stackTop;
+
+  ObjFiber* fiber = vm->fiber;
+  if (fiber != NULL) {
+    fiber->state = FIBER_WAITING;
+    if (!fiber->fromLoop) {
+      returnToCaller(vm, fiber, NIL_VAL);
+      return NIL_VAL;
+    }
+  }
+  schedule(vm); // Always finds something, since 'waiter' is pending
+  return NIL_VAL;
+}
+
+// yield(value) suspends the running fiber; its resume() returns 'value'.
+// Does nothing in the main script. A fiber the event loop is running has
+// nobody to yield to, so it just lets the other ready code go first.
+static Value yieldNative(VM* vm, int argCount, Value* args) {
+  if (argCount > 1 || vm->fiber == NULL) return NIL_VAL;
+  Value value = argCount == 1 ? args[0] : NIL_VAL;
+
+  ObjFiber* fiber = vm->fiber;
+  if (fiber->fromLoop) return waitFor(vm, newWaiter(WAIT_SLEEP, -1), argCount);
+  vm->stackTop -= argCount + 1;
+  fiber->frameCount = vm->frameCount;
+  fiber->stackTop = vm->stackTop;
+  fiber->state = FIBER_SUSPENDED;
+  returnToCaller(vm, fiber, value);
+  return NIL_VAL;
+}
+
+static Value doneNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_FIBER(args[0])) return NIL_VAL;
+  return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+// --- Event loop ---
+// I/O that can't finish at once parks the fiber that asked for it (or
+// the main script) instead of blocking the thread; see waitFor(). File
+// descriptors are plain integers.
+
+static bool fdArg(Value value, int* fd) {
+  int64_t integer;
+  if (!toInteger(value, &integer) || integer < 0 || integer > INT32_MAX) {
+    return false;
+  }
+  *fd = (int)integer;
+  return true;
+}
+
+// Copies a dotted IPv4 address into 'host', which has room for 16 bytes
+static bool hostArg(Value value, char* host) {
+  if (!IS_STRING_LIKE(value) || STRING_LENGTH(value) > 15) return false;
+  memcpy(host, STRING_CHARS(value), STRING_LENGTH(value));
+  host[STRING_LENGTH(value)] = '\0';
+  return true;
+}
+
+// sleep(ms) returns nil after 'ms' milliseconds
+static Value sleepNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_NUMERIC(args[0])) return NIL_VAL;
+  double ms = TO_DOUBLE(args[0]);
+  Waiter* waiter = newWaiter(WAIT_SLEEP, -1);
+  waiter->deadline = ms > 0 ? (int64_t)fmin(ms, (double)INT32_MAX) : 0;
+  return waitFor(vm, waiter, argCount);
+}
+
+// read(fd) returns the next bytes to arrive, up to 64 KB, or nil at the
+// end of the input
+static Value readNative(VM* vm, int argCount, Value* args) {
+  int fd;
+  if (argCount != 1 || !fdArg(args[0], &fd)) return NIL_VAL;
+  return waitFor(vm, newWaiter(WAIT_READ, fd), argCount);
+}
+
+// write(fd, s) returns the length of 's' once all of it is written
+static Value writeNative(VM* vm, int argCount, Value* args) {
+  int fd;
+  if (argCount != 2 || !fdArg(args[0], &fd) || !IS_STRING_LIKE(args[1])) {
+    return NIL_VAL;
+  }
+  if (fd == STDOUT_FILENO) fflush(stdout); // Keep order with 'print'
+  Waiter* waiter = newWaiter(WAIT_WRITE, fd);
+  waiter->chars = STRING_CHARS(args[1]);
+  waiter->length = STRING_LENGTH(args[1]);
+  return waitFor(vm, waiter, argCount);
+}
+
+// listen(host, port) returns a listening TCP socket. Port 0 picks a
+// free one; localPort() tells which.
+static Value listenNative(VM* vm, int argCount, Value* args) {
+  char host[16];
+  int port;
+  if (argCount != 2 || !hostArg(args[0], host) || !fdArg(args[1], &port)) {
+    return NIL_VAL;
+  }
+  int fd = listenOn(vm, host, port);
+  return fd < 0 ? NIL_VAL : INT_VAL(fd);
+}
+
+// accept(socket) returns the next incoming connection
+static Value acceptNative(VM* vm, int argCount, Value* args) {
+  int fd;
+  if (argCount != 1 || !fdArg(args[0], &fd)) return NIL_VAL;
+  return waitFor(vm, newWaiter(WAIT_ACCEPT, fd), argCount);
+}
+
+// connect(host, port) returns a connected TCP socket
+static Value connectNative(VM* vm, int argCount, Value* args) {
+  char host[16];
+  int port;
+  if (argCount != 2 || !hostArg(args[0], host) || !fdArg(args[1], &port)) {
+    return NIL_VAL;
+  }
+  int fd = connectTo(vm, host, port);
+  if (fd < 0) return NIL_VAL;
+  return waitFor(vm, newWaiter(WAIT_CONNECT, fd), argCount);
+}
+
+// close(fd) also wakes anything waiting on it, with nil
+static Value closeNative(VM* vm, int argCount, Value* args) {
+  int fd;
+  if (argCount != 1 || !fdArg(args[0], &fd)) return NIL_VAL;
+  return BOOL_VAL(closeFd(vm, fd));
+}
+
+static Value localPortNative(VM* vm, int argCount, Value* args) {
+  int fd;
+  if (argCount != 1 || !fdArg(args[0], &fd)) return NIL_VAL;
+  int port = localPort(fd);
+  return port < 0 ? NIL_VAL : INT_VAL(port);
+}
+
+typedef struct {
+  const char* name;
+  NativeFn function;
+} NativeDef;
+
+// Every native the VM knows about. Heap snapshots refer to natives by
+// name, so this table is also how a restored image finds its C functions.
+static const NativeDef natives[] = {
+  {"clock", clockNative}, //Supporting time
+  {"sqrt",  sqrtNative},  //Supporting Square root
+  {"floor", floorNative}, // Supporting floor op
+  {"input", inputNative}, //Taking Input form the user
+  {"pow",   powNative},   //Power Operator;
+  {"len",    lenNative},    // Length of a list, string or map
+  {"append", appendNative}, // Add to the end of a list
+  {"substr",  substrNative},  // Parts of strings, sharing their characters
+  {"indexOf", indexOfNative},
+  {"split",   splitNative},
+  {"count",   countNative},
+  {"replace", replaceNative},
+  {"trim",    trimNative},
+  {"startsWith", startsWithNative},
+  {"floatArray", floatArrayNative}, // Float64Array from a size or a list
+  {"sum",        sumNative},        // Float64Array reductions
+  {"dot",        dotNative},
+  {"min",        minNative},
+  {"max",        maxNative},
+  {"scale",      scaleNative},      // Element-wise, returning a new array
+  {"add",        addNative},
+  {"mul",        mulNative},
+  {"prefixSum",  prefixSumNative},
+  {"keys",       keysNative},       // Map entries, as lists
+  {"values",     valuesNative},
+  {"has",        hasNative},        // Map membership
+  {"remove",     removeNative},
+  {"spawn",   spawnNative},   // Isolates on the thread pool
+  {"send",    sendNative},
+  {"receive", receiveNative},
+  {"fiber",   fiberNative},   // Coroutines within this VM
+  {"resume",  resumeNative},
+  {"yield",   yieldNative},
+  {"done",    doneNative},
+  {"sleep",     sleepNative},     // I/O and timers on the event loop
+  {"read",      readNative},
+  {"write",     writeNative},
+  {"listen",    listenNative},
+  {"accept",    acceptNative},
+  {"connect",   connectNative},
+  {"close",     closeNative},
+  {"localPort", localPortNative},
+};
+
+#define NATIVE_COUNT (int)(sizeof(natives) / sizeof(natives[0]))
+
+static void defineNative(VM* vm, const char* name, NativeFn function) {
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function)));
+  tableSet(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+  pop(vm);
+  pop(vm);
+}
+
+const char* nativeName(NativeFn function) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if (natives[i].function == function) return natives[i].name;
+  }
+  return NULL;
+}
+
+NativeFn findNative(const char* name, int length) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if ((int)strlen(natives[i].name) == length &&
+        memcmp(natives[i].name, name, length) == 0) {
+      return natives[i].function;
+    }
+  }
+  return NULL;
+}
+
+static void initVMState(VM* vm) {
+  resetStack(vm);
+  vm->objects = NULL;
+  vm->bytesAllocated = 0;
+  vm->isolate = 0;
+  vm->events = NULL;
+  vm->switched = false;
+  initStringSet(&vm->strings);
+  initTable(&vm->globals);
+  initTable(&vm->constNames);
+  initTable(&vm->constValues);
+  vm->initString = copyString(vm, "init", 4);
+}
+
+void initVM(VM* vm) {
+  initVMState(vm);
+
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    defineNative(vm, natives[i].name, natives[i].function);
+  }
+}
+
+// Boots the VM from a heap image instead of defining the natives from
+// scratch. On failure the VM is left empty but valid.
+bool initVMFromSnapshot(VM* vm, const char* path) {
+  initVMState(vm);
+  return loadSnapshot(vm, path);
+}
+
+void freeVM(VM* vm) {
+  freeEvents(vm);
+  freeTable(vm, &vm->globals);
+  freeTable(vm, &vm->constNames);
+  freeTable(vm, &vm->constValues);
+  freeStringSet(vm, &vm->strings);
+  freeObjects(vm);
+}
+
+void push(VM* vm, Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
+}
+
+Value pop(VM* vm) {
+  vm->stackTop--;
+  return *vm->stackTop;
+}
+
+static Value peek(VM* vm, int distance) {
+  return vm->stackTop[-1 - distance];
 }
 
 //VM Helper Functions
@@ -126,65 +819,208 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(peek(0));
-  ObjString* a = AS_STRING(peek(1));
+static void concatenate(VM* vm) {
+  Value b = peek(vm, 0);
+  Value a = peek(vm, 1);
 
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
+  int length = STRING_LENGTH(a) + STRING_LENGTH(b);
+  char* chars = ALLOCATE(vm, char, length + 1);
+  memcpy(chars, STRING_CHARS(a), STRING_LENGTH(a));
+  memcpy(chars + STRING_LENGTH(a), STRING_CHARS(b), STRING_LENGTH(b));
   chars[length] = '\0';
 
-  ObjString* result = takeString(chars, length);
-  pop();
-  pop();
-  push(OBJ_VAL(result));
+  ObjString* result = takeString(vm, chars, length);
+  pop(vm);
+  pop(vm);
+  push(vm, OBJ_VAL(result));
+}
+
+static bool mapInsert(VM* vm, ObjMap* map, Value key, Value value) {
+  if (!mapKey(vm, key, &key)) {
+    runtimeError(vm, "Map key must be a string or a number.");
+    return false;
+  }
+  tableSetValue(vm, &map->table, key, value);
+  return true;
+}
+
+// Checks that 'index' is a valid position in a list or array of 'count'
+static bool checkIndex(VM* vm, Value index, int count, int* position) {
+  if (IS_INT(index)) {
+    if (AS_INT(index) < 0 || AS_INT(index) >= count) {
+      runtimeError(vm, "List index out of range.");
+      return false;
+    }
+    *position = (int)AS_INT(index);
+    return true;
+  }
+
+  if (!IS_NUMBER(index)) {
+    runtimeError(vm, "List index must be a number.");
+    return false;
+  }
+
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < count)) {
+    runtimeError(vm, "List index out of range.");
+    return false;
+  }
+  if (number != (int)number) {
+    runtimeError(vm, "List index must be an integer.");
+    return false;
+  }
+
+  *position = (int)number;
+  return true;
 }
 
 //Core Execution
 
-static bool call(ObjClosure* closure, int argCount) {
+// Replaces the instance on top of the stack with its method 'name'
+// bound to it
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+  pop(vm);
+  push(vm, OBJ_VAL(bound));
+  return true;
+}
+
+// Finds the entry of 'cache' for 'shape', if it has one
+static inline CacheEntry* cacheLookup(InlineCache* cache, ObjShape* shape) {
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+static CacheEntry* cacheFill(InlineCache* cache, ObjShape* shape,
+                             ObjShape* target, int slot) {
+  CacheEntry* entry = &cache->entries[INLINE_CACHE_WAYS - 1];
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == NULL) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+  entry->shape = shape;
+  entry->target = target;
+  entry->slot = slot;
+  entry->method = NULL;
+  return entry;
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
+  ObjFunction* function = closure->function;
+  if (function->lazySource != NULL && !compileLazyFunction(vm, function)) {
+    runtimeError(vm, "Could not compile function '%s'.", function->name->chars);
+    return false;
+  }
+
   if (argCount != closure->function->arity) {
-    runtimeError("Expected %d arguments but got %d.",
+    runtimeError(vm, "Expected %d arguments but got %d.",
         closure->function->arity, argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+  if (vm->frameCount == FRAMES_MAX) {
+    runtimeError(vm, "Stack overflow.");
+    return false;
+  }
+
+  // The compiler worked out how deep this frame can grow, so one check
+  // here keeps every push() inside it in bounds.
+  Value* slots = vm->stackTop - argCount - 1;
+  if (function->maxSlots > vm->stackLimit - slots) {
+    runtimeError(vm, "Stack overflow.");
     return false;
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  CallFrame* frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = slots;
   return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM* vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
+      case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
+      }
+      case OBJ_CLASS: {
+        ObjClass* klass = AS_CLASS(callee);
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+        Value initializer;
+        if (tableGet(&klass->methods, vm->initString, &initializer)) {
+          return call(vm, AS_CLOSURE(initializer), argCount);
+        } else if (argCount != 0) {
+          runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+          return false;
+        }
+        return true;
+      }
       case OBJ_CLOSURE:
-        return call(AS_CLOSURE(callee), argCount);
+        return call(vm, AS_CLOSURE(callee), argCount);
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
+        vm->switched = false;
+        Value result = native(vm, argCount, vm->stackTop - argCount);
+        if (vm->switched) return true; // resume(), yield() or waiting
+        vm->stackTop -= argCount + 1;
+        push(vm, result);
         return true;
       }
       default:
         break;
     }
   }
-  runtimeError("Can only call functions and classes.");
+  runtimeError(vm, "Can only call functions and classes.");
   return false;
 }
 
-static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+// Calls method 'name' on the receiver below the arguments, which stays
+// put as the callee's slot zero. The cache keeps the method found for
+// each receiver shape; a shape implies the class, and a class's methods
+// never change once it is declared.
+static bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+  Value receiver = peek(vm, argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError(vm, "Only instances have methods.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  CacheEntry* entry = cacheLookup(cache, instance->shape);
+  if (entry == NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    Value method = NIL_VAL;
+    if (slot == -1 && !tableGet(&instance->klass->methods, name, &method)) {
+      runtimeError(vm, "Undefined property '%s'.", name->chars);
+      return false;
+    }
+    entry = cacheFill(cache, instance->shape, instance->shape, slot);
+    if (slot == -1) entry->method = AS_CLOSURE(method);
+  }
+
+  if (entry->method != NULL) return call(vm, entry->method, argCount);
+
+  // A field holding something callable
+  Value field = instance->fields[entry->slot];
+  vm->stackTop[-argCount - 1] = field;
+  return callValue(vm, field, argCount);
+}
+
+static InterpretResult run(VM* vm) {
+  CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
   // MACROS
   #define READ_BYTE() (*frame->ip++)
@@ -197,21 +1033,60 @@ static InterpretResult run() {
 
   #define READ_STRING() AS_STRING(READ_CONSTANT())
 
-  #define BINARY_OP(valueType, op) \
+  #define READ_CACHE() \
+      (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+  // Two integers compare exactly; anything else compares as doubles
+  #define COMPARE_OP(op) \
+      do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        if (IS_INT(a) && IS_INT(b)) { \
+          vm->stackTop -= 2; \
+          push(vm, BOOL_VAL(AS_INT(a) op AS_INT(b))); \
+        } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) { \
+          vm->stackTop -= 2; \
+          push(vm, BOOL_VAL(TO_DOUBLE(a) op TO_DOUBLE(b))); \
+        } else { \
+          runtimeError(vm, "Operands must be numbers."); \
+          return INTERPRET_RUNTIME_ERROR; \
+        } \
+      } while (false)
+
+  // Integers that don't overflow take the inline path; everything else,
+  // including the promotion to double, goes through 'slowPath'.
+  #define ARITHMETIC_OP(overflows, slowPath) \
       do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-          runtimeError("Operands must be numbers."); \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        int64_t result; \
+        if (IS_INT(a) && IS_INT(b) && !overflows(AS_INT(a), AS_INT(b), &result)) { \
+          vm->stackTop -= 2; \
+          push(vm, INT_VAL(result)); \
+        } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) { \
+          vm->stackTop -= 2; \
+          push(vm, slowPath(a, b)); \
+        } else { \
+          runtimeError(vm, "Operands must be numbers."); \
           return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+      } while (false)
+
+  #define BITWISE_OP(expression) \
+      do { \
+        int64_t i, j; \
+        if (!toInteger(peek(vm, 1), &i) || !toInteger(peek(vm, 0), &j)) { \
+          runtimeError(vm, "Operands must be integers."); \
+          return INTERPRET_RUNTIME_ERROR; \
+        } \
+        vm->stackTop -= 2; \
+        push(vm, INT_VAL(expression)); \
       } while (false)
 
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
     printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
       printf("[ ");
       printValue(*slot);
       printf(" ]");
@@ -225,84 +1100,127 @@ static InterpretResult run() {
     switch (instruction = READ_BYTE()) {
       case OP_CONSTANT: {
         Value constant = READ_CONSTANT();
-        push(constant);
+        push(vm, constant);
         break;
       }
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP: pop(); break;
+      case OP_NIL: push(vm, NIL_VAL); break;
+      case OP_TRUE: push(vm, BOOL_VAL(true)); break;
+      case OP_FALSE: push(vm, BOOL_VAL(false)); break;
+      case OP_POP: pop(vm); break;
       case OP_GET_LOCAL: {
         uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
+        push(vm, frame->slots[slot]);
         break;
       }
       case OP_SET_LOCAL: {
         uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
+        frame->slots[slot] = peek(vm, 0);
         break;
       }
       case OP_GET_GLOBAL: {
         ObjString* name = READ_STRING();
         Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
+        if (!tableGet(&vm->globals, name, &value)) {
+          runtimeError(vm, "Undefined variable '%s'.", name->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
-        push(value);
+        push(vm, value);
         break;
       }
       case OP_DEFINE_GLOBAL: {
         ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
+        tableSet(vm, &vm->globals, name, peek(vm, 0));
+        pop(vm);
         break;
       }
       case OP_SET_GLOBAL: {
         ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name); 
-          runtimeError("Undefined variable '%s'.", name->chars);
+        if (tableSet(vm, &vm->globals, name, peek(vm, 0))) {
+          tableDelete(vm, &vm->globals, name); 
+          runtimeError(vm, "Undefined variable '%s'.", name->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
         break;
       }
       case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
+        Value b = pop(vm);
+        Value a = pop(vm);
+        push(vm, BOOL_VAL(valuesEqual(a, b)));
         break;
       }
-      case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+      case OP_GREATER:  COMPARE_OP(>); break;
+      case OP_LESS:     COMPARE_OP(<); break;
       case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+        int64_t result;
+        if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1)) &&
+            !__builtin_add_overflow(AS_INT(peek(vm, 1)), AS_INT(peek(vm, 0)), &result)) {
+          vm->stackTop -= 2;
+          push(vm, INT_VAL(result));
+        } else if (IS_STRING_LIKE(peek(vm, 0)) && IS_STRING_LIKE(peek(vm, 1))) {
+          concatenate(vm);
+        } else if (IS_NUMERIC(peek(vm, 0)) && IS_NUMERIC(peek(vm, 1))) {
+          Value b = pop(vm);
+          Value a = pop(vm);
+          push(vm, addNumbers(a, b));
         } else {
-          runtimeError("Operands must be two numbers or two strings.");
+          runtimeError(vm, "Operands must be two numbers or two strings.");
           return INTERPRET_RUNTIME_ERROR;
         }
         break;
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+      case OP_SUBTRACT:
+        ARITHMETIC_OP(__builtin_sub_overflow, subtractNumbers);
+        break;
+      case OP_MULTIPLY:
+        ARITHMETIC_OP(__builtin_mul_overflow, multiplyNumbers);
+        break;
+      case OP_DIVIDE: {
+        if (!IS_NUMERIC(peek(vm, 0)) || !IS_NUMERIC(peek(vm, 1))) {
+          runtimeError(vm, "Operands must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        Value b = pop(vm);
+        Value a = pop(vm);
+        push(vm, divideNumbers(a, b));
+        break;
+      }
+      case OP_MODULO: {
+        if (!IS_NUMERIC(peek(vm, 0)) || !IS_NUMERIC(peek(vm, 1))) {
+          runtimeError(vm, "Operands must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        Value b = pop(vm);
+        Value a = pop(vm);
+        push(vm, moduloNumbers(a, b));
+        break;
+      }
+      case OP_BIT_AND:     BITWISE_OP(i & j); break;
+      case OP_BIT_OR:      BITWISE_OP(i | j); break;
+      case OP_BIT_XOR:     BITWISE_OP(i ^ j); break;
+      case OP_SHIFT_LEFT:  BITWISE_OP(shiftLeft(i, j)); break;
+      case OP_SHIFT_RIGHT: BITWISE_OP(shiftRight(i, j)); break;
       case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
+        push(vm, BOOL_VAL(isFalsey(pop(vm))));
         break;
       case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
+        if (!IS_NUMERIC(peek(vm, 0))) {
+          runtimeError(vm, "Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
+        push(vm, negateNumber(pop(vm)));
         break;
+      case OP_BIT_NOT: {
+        int64_t integer;
+        if (!toInteger(peek(vm, 0), &integer)) {
+          runtimeError(vm, "Operand must be an integer.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        pop(vm);
+        push(vm, INT_VAL(~integer));
+        break;
+      }
       case OP_PRINT: {
-        printValue(pop());
+        printValue(pop(vm));
         printf("\n");
         break;
       }
@@ -313,7 +1231,7 @@ static InterpretResult run() {
       }
       case OP_JUMP_IF_FALSE: {
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
+        if (isFalsey(peek(vm, 0))) frame->ip += offset;
         break;
       }
       case OP_LOOP: {
@@ -323,29 +1241,241 @@ static InterpretResult run() {
       }
       case OP_CALL: {
         int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
+        if (!callValue(vm, peek(vm, argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
+        frame = &vm->frames[vm->frameCount - 1];
         break;
       }
       case OP_CLOSURE: {
         ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
+        ObjClosure* closure = newClosure(vm, function);
+        push(vm, OBJ_VAL(closure));
+        break;
+      }
+      case OP_PEEK: push(vm, peek(vm, READ_BYTE())); break;
+      case OP_INLINE_GUARD: {
+        int argCount = READ_BYTE();
+        ObjFunction* inlined = AS_FUNCTION(READ_CONSTANT());
+        uint16_t offset = READ_SHORT();
+        Value callee = peek(vm, argCount);
+        if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function != inlined) {
+          frame->ip += offset;
+        }
+        break;
+      }
+      case OP_INLINE_RETURN: {
+        int argCount = READ_BYTE();
+        Value result = pop(vm);
+        vm->stackTop -= argCount + 1;
+        push(vm, result);
+        break;
+      }
+      case OP_BUILD_LIST: {
+        int count = READ_BYTE();
+        ObjList* list = newList(vm);
+        if (count > 0) {
+          list->items.values = GROW_ARRAY(vm, Value, NULL, 0, count);
+          list->items.capacity = count;
+          list->items.count = count;
+          memcpy(list->items.values, vm->stackTop - count, sizeof(Value) * count);
+        }
+        vm->stackTop -= count;
+        push(vm, OBJ_VAL(list));
+        break;
+      }
+      case OP_LIST_APPEND: {
+        Value item = pop(vm);
+        writeValueArray(vm, &AS_LIST(peek(vm, 0))->items, item);
+        break;
+      }
+      case OP_BUILD_MAP: {
+        int count = READ_BYTE();
+        ObjMap* map = newMap(vm);
+        for (Value* pair = vm->stackTop - count * 2; pair < vm->stackTop; pair += 2) {
+          if (!mapInsert(vm, map, pair[0], pair[1])) return INTERPRET_RUNTIME_ERROR;
+        }
+        vm->stackTop -= count * 2;
+        push(vm, OBJ_VAL(map));
+        break;
+      }
+      case OP_MAP_INSERT: {
+        if (!mapInsert(vm, AS_MAP(peek(vm, 2)), peek(vm, 1), peek(vm, 0))) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        vm->stackTop -= 2;
+        break;
+      }
+      case OP_CLASS:
+        push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+        break;
+      case OP_METHOD: {
+        ObjString* name = READ_STRING();
+        tableSet(vm, &AS_CLASS(peek(vm, 1))->methods, name, peek(vm, 0));
+        pop(vm);
+        break;
+      }
+      case OP_GET_PROPERTY: {
+        if (!IS_INSTANCE(peek(vm, 0))) {
+          runtimeError(vm, "Only instances have properties.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+        ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
+
+        CacheEntry* entry = cacheLookup(cache, instance->shape);
+        int slot;
+        if (entry != NULL) {
+          slot = entry->slot;
+        } else {
+          slot = shapeSlot(instance->shape, name);
+          if (slot == -1) {
+            // Not a field, so a method
+            if (!bindMethod(vm, instance->klass, name)) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+          }
+          cacheFill(cache, instance->shape, instance->shape, slot);
+        }
+        vm->stackTop[-1] = instance->fields[slot];
+        break;
+      }
+      case OP_SET_PROPERTY: {
+        if (!IS_INSTANCE(peek(vm, 1))) {
+          runtimeError(vm, "Only instances have fields.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+        ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
+
+        CacheEntry* entry = cacheLookup(cache, instance->shape);
+        if (entry != NULL) {
+          instanceStore(vm, instance, entry->target, entry->slot, peek(vm, 0));
+        } else {
+          ObjShape* shape = instance->shape;
+          ObjShape* target = shape;
+          int slot = shapeSlot(shape, name);
+          if (slot == -1) {
+            target = shapeAddField(vm, shape, name);
+            slot = shape->fieldCount;
+          }
+          cacheFill(cache, shape, target, slot);
+          instanceStore(vm, instance, target, slot, peek(vm, 0));
+        }
+        Value value = pop(vm);
+        pop(vm);
+        push(vm, value);
+        break;
+      }
+      case OP_INVOKE: {
+        ObjString* name = READ_STRING();
+        int argCount = READ_BYTE();
+        if (!invoke(vm, name, argCount, READ_CACHE())) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm->frames[vm->frameCount - 1];
+        break;
+      }
+      case OP_INDEX_GET: {
+        int index;
+        if (IS_LIST(peek(vm, 1))) {
+          ObjList* list = AS_LIST(peek(vm, 1));
+          if (!checkIndex(vm, peek(vm, 0), list->items.count, &index)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          vm->stackTop -= 2;
+          push(vm, list->items.values[index]);
+        } else if (IS_FLOAT_ARRAY(peek(vm, 1))) {
+          ObjFloatArray* array = AS_FLOAT_ARRAY(peek(vm, 1));
+          if (!checkIndex(vm, peek(vm, 0), array->count, &index)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          vm->stackTop -= 2;
+          push(vm, NUMBER_VAL(array->values[index]));
+        } else if (IS_MAP(peek(vm, 1))) {
+          Value key, value;
+          if (!mapKey(vm, peek(vm, 0), &key)) {
+            runtimeError(vm, "Map key must be a string or a number.");
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          // A missing key reads as nil
+          if (!tableGetValue(&AS_MAP(peek(vm, 1))->table, key, &value)) {
+            value = NIL_VAL;
+          }
+          vm->stackTop -= 2;
+          push(vm, value);
+        } else {
+          runtimeError(vm, "Can only index lists, arrays and maps.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        break;
+      }
+      case OP_INDEX_SET: {
+        int index;
+        if (IS_LIST(peek(vm, 2))) {
+          ObjList* list = AS_LIST(peek(vm, 2));
+          if (!checkIndex(vm, peek(vm, 1), list->items.count, &index)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          list->items.values[index] = peek(vm, 0);
+        } else if (IS_FLOAT_ARRAY(peek(vm, 2))) {
+          ObjFloatArray* array = AS_FLOAT_ARRAY(peek(vm, 2));
+          if (!checkIndex(vm, peek(vm, 1), array->count, &index)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          if (!IS_NUMERIC(peek(vm, 0))) {
+            runtimeError(vm, "Float64Array elements must be numbers.");
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          array->values[index] = TO_DOUBLE(peek(vm, 0));
+        } else if (IS_MAP(peek(vm, 2))) {
+          if (!mapInsert(vm, AS_MAP(peek(vm, 2)), peek(vm, 1), peek(vm, 0))) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+        } else {
+          runtimeError(vm, "Can only index lists, arrays and maps.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        Value value = pop(vm);
+        vm->stackTop -= 2;
+        push(vm, value);
         break;
       }
       case OP_RETURN: {
-        Value result = pop();
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
+        Value result = pop(vm);
+        vm->frameCount--;
+        if (vm->frameCount == 0 && vm->fiber != NULL) {
+          // A fiber's function returned, so resume() returns its result
+          ObjFiber* fiber = vm->fiber;
+          fiber->state = FIBER_DONE;
+          fiber->frameCount = 0;
+          fiber->stackTop = fiber->stack;
+          if (!fiber->fromLoop) {
+            returnToCaller(vm, fiber, result);
+          } else if (!schedule(vm)) {
+            // The main script is done and nothing else is waiting
+            resetStack(vm);
+            return INTERPRET_OK;
+          }
+          frame = &vm->frames[vm->frameCount - 1];
+          break;
+        }
+        if (vm->frameCount == 0) {
+          pop(vm);
+          // Fibers still waiting on I/O or timers get to finish
+          if (schedule(vm)) {
+            frame = &vm->frames[vm->frameCount - 1];
+            break;
+          }
           return INTERPRET_OK;
         }
 
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
+        vm->stackTop = frame->slots;
+        push(vm, result);
+        frame = &vm->frames[vm->frameCount - 1];
         break;
       }
     }
@@ -355,18 +1485,21 @@ static InterpretResult run() {
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
-#undef BINARY_OP
+#undef READ_CACHE
+#undef COMPARE_OP
+#undef ARITHMETIC_OP
+#undef BITWISE_OP
 }
 
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source, size_t length, int line) {
+  ObjFunction* function = compile(vm, source, length, line);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-  push(OBJ_VAL(function));
-  ObjClosure* closure = newClosure(function);
-  pop();
-  push(OBJ_VAL(closure));
-  call(closure, 0);
+  push(vm, OBJ_VAL(function));
+  ObjClosure* closure = newClosure(vm, function);
+  pop(vm);
+  push(vm, OBJ_VAL(closure));
+  if (!call(vm, closure, 0)) return INTERPRET_RUNTIME_ERROR;
 
-  return run();
+  return run(vm);
 }
\ No newline at end of file
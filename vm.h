@@ -6,32 +6,52 @@
 #include "table.h"
 #include "object.h"
 #include "common.h"
+#include "event.h"
 
 //Starting with a fixed-size stack
 //#define STACK_MAX 256
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Fibers are meant to be many and cheap, so they get a smaller stack
+#define FIBER_STACK_MAX (4 * UINT8_COUNT)
 
-typedef struct {
+typedef struct CallFrame {
   ObjClosure* closure;
   uint8_t* ip;
   Value* slots; // Pointer to the start of this frame's stack window
 } CallFrame;
 
-typedef struct {
-  CallFrame frames[FRAMES_MAX];
+// All of an interpreter's state. Nothing is shared between instances, so
+// each thread can run its own.
+struct VM {
+  // The running fiber's frames and stack, or the main script's. Switching
+  // fibers just repoints these.
+  CallFrame* frames;
   int frameCount;
-
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop;
+  Value* stackLimit; // One past the last slot of 'stack'
+  ObjFiber* fiber;   // NULL while the main script runs
+
+  CallFrame mainFrames[FRAMES_MAX];
+  Value mainStack[STACK_MAX];
   Table globals;
-  Table strings;
+  // Global constants, kept across compilations (REPL lines, lazy bodies,
+  // stream pieces); the ones with a compile-time value are also in
+  // constValues
+  Table constNames;
+  Table constValues;
+  StringSet strings;
+  ObjString* initString; // "init", the initializer's method name
   
   size_t bytesAllocated;
   size_t nextGC;
   
   Obj* objects;
-} VM;
+  int isolate; // Id of the isolate this VM runs (see isolate.h)
+  EventLoop* events; // Created by the first I/O call that has to wait
+  bool switched;     // Set when a native switches to other code to run
+};
 
 typedef enum{
     INTERPRET_OK,
@@ -39,12 +59,14 @@ typedef enum{
     INTERPRET_RUNTIME_ERROR,
 }InterpretResult;
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+void initVM(VM* vm);
+bool initVMFromSnapshot(VM* vm, const char* path);
+void freeVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source, size_t length, int line);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
-extern VM vm; 
+const char* nativeName(NativeFn function);
+NativeFn findNative(const char* name, int length);
 
 #endif
\ No newline at end of file